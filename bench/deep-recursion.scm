@@ -0,0 +1,5 @@
+(begin
+  (define sum (lambda (n)
+    (if (= n 0) 0 (+ n (sum (- n 1))))))
+  (display (sum 10000))
+)
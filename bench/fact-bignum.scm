@@ -0,0 +1,5 @@
+(begin
+  (define fact (lambda (n)
+    (if (<= n 1) 1 (* n (fact (- n 1))))))
+  (display (fact 100))
+)
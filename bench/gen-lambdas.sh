@@ -0,0 +1,35 @@
+#!/bin/sh
+## Write a synthetic program with N lambdas (default 100000) to stdout, to
+## stress the compiler: the lambdas are bound to symbols longer than 200
+## characters and call each other in chains of 1000, followed by an
+## expression nested DEPTH (default 1000) deep, lambdas nested 100 deep
+## and a call with 300 arguments. The program displays
+## (N DEPTH 100 300).
+N=${1:-100000}
+DEPTH=${2:-1000}
+awk -v n="$N" -v depth="$DEPTH" 'BEGIN {
+	pre = "f"
+	for (i = 0; i < 200; i++) pre = pre "-"
+	print "(begin"
+	for (i = 0; i < n; i++) {
+		if (i % 1000 == 0) printf "(define %s%d (lambda (x) (+ x 1)))\n", pre, i
+		else printf "(define %s%d (lambda (x) (+ (%s%d x) 1)))\n", pre, i, pre, i - 1
+	}
+	printf "(define total"
+	for (i = 0; i < n; i++) if (i % 1000 == 999 || i == n - 1) printf " (+ (%s%d 0)", pre, i
+	printf " 0"
+	for (i = 0; i < n; i++) if (i % 1000 == 999 || i == n - 1) printf ")"
+	print ")"
+	printf "(define nested "
+	for (i = 0; i < depth; i++) printf "(+ 1 "
+	printf "0"
+	for (i = 0; i < depth; i++) printf ")"
+	print ")"
+	s = "(+ x0 x99 1)"
+	for (i = 99; i >= 0; i--) s = "((lambda (x" i ") " s ") " (i ? "(+ x" i - 1 " 1)" : "0") ")"
+	print "(define lambdas " s ")"
+	printf "(define args (length (list"
+	for (i = 1; i <= 300; i++) printf " %d", i
+	print ")))"
+	print "(display (list total nested lambdas args)))"
+}'
@@ -0,0 +1,12 @@
+(begin
+  (define table (make-hash-table))
+  (let fill ((i 0))
+    (if (< i 1000000) (begin (hash-table-set! table i i) (fill (+ i 1)))))
+  (define keys (sort (hash-table-keys table) <))
+  (define doubled (map (lambda (x) (* x 2)) keys))
+  (define small (filter (lambda (x) (< x 1000)) doubled))
+  (define sum (fold-left + 0 doubled))
+  (define count 0)
+  (for-each (lambda (x y) (set! count (+ count 1))) keys doubled)
+  (display (list (length small) sum (fold-right (lambda (x acc) (+ acc 1)) 0 keys) (reduce + 0 small) count))
+)
@@ -0,0 +1,53 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+
+/// Run a command and print its wall time in seconds, peak RSS in KiB
+/// and exit status. The command's stdout goes to the file given with -o.
+int
+main(int argc, char *argv[])
+{
+	int argi = 1;
+	char *out_file = NULL;
+	if (argc > 2 && strcmp(argv[1], "-o") == 0) {
+		out_file = argv[2];
+		argi = 3;
+	}
+	if (argi >= argc) {
+		fprintf(stderr, "usage: %s [-o file] command [args ...]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	struct timespec beg, end;
+	clock_gettime(CLOCK_MONOTONIC, &beg);
+	pid_t pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		return EXIT_FAILURE;
+	}
+	if (pid == 0) {
+		if (out_file) {
+			int fd = open(out_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+			if (fd < 0 || dup2(fd, STDOUT_FILENO) < 0) _exit(127);
+			close(fd);
+		}
+		execvp(argv[argi], argv + argi);
+		_exit(127);
+	}
+	int status;
+	struct rusage ru;
+	if (wait4(pid, &status, 0, &ru) < 0) {
+		perror("wait4");
+		return EXIT_FAILURE;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	double wall = (end.tv_sec - beg.tv_sec) + (end.tv_nsec - beg.tv_nsec) / 1e9;
+	int code = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+	printf("%.6f %ld %d\n", wall, ru.ru_maxrss, code);
+	return EXIT_SUCCESS;
+}
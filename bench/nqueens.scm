@@ -0,0 +1,15 @@
+(begin
+  (define safe (lambda (row dist placed)
+    (if (null? placed) 1
+        (if (= (car placed) (+ row dist)) 0
+            (if (= (car placed) (- row dist)) 0
+                (if (= (car placed) row) 0
+                    (safe row (+ dist 1) (cdr placed))))))))
+  (define queens (lambda (n k placed)
+    (if (= k n) 1 (try-cols n k 1 placed))))
+  (define try-cols (lambda (n k col placed)
+    (if (> col n) 0
+        (+ (if (= (safe col 1 placed) 1) (queens n (+ k 1) (cons col placed)) 0)
+           (try-cols n k (+ col 1) placed)))))
+  (display (queens 8 0 (quote ())))
+)
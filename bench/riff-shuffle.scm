@@ -0,0 +1,15 @@
+(begin
+  (define combine (lambda (f)
+    (lambda (x y)
+    (if (null? x) (quote ())
+        (f (list (car x) (car y))
+           ((combine f) (cdr x) (cdr y)))))))
+  (define riff-shuffle (lambda (deck) (begin
+    (define take (lambda (n seq) (if (<= n 0) (quote ()) (cons (car seq) (take (- n 1) (cdr seq))))))
+    (define drop (lambda (n seq) (if (<= n 0) seq (drop (- n 1) (cdr seq)))))
+    (define mid (lambda (seq) (/ (length seq) 2)))
+    ((combine append) (take (mid deck) deck) (drop (mid deck) deck)))))
+  (define iota (lambda (n acc) (if (= n 0) acc (iota (- n 1) (cons n acc)))))
+  (define shuffle-n (lambda (k deck) (if (= k 0) deck (shuffle-n (- k 1) (riff-shuffle deck)))))
+  (display (shuffle-n 8 (iota 52 (quote ()))))
+)
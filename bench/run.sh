@@ -0,0 +1,36 @@
+#!/bin/sh
+## Compile and run every bench/*.scm RUNS times and report the median
+## compile latency (emit and build), median run time and peak RSS.
+## Results are also written as CSV to bench/results.csv, or to $RESULTS.
+cd "$(dirname "$0")/.." || exit 1
+RUNS=${RUNS:-5}
+RESULTS=${RESULTS:-bench/results.csv}
+MEASURE=bench/measure
+
+median() {
+	sort -n | awk '{ v[NR] = $1 } END { print v[int((NR + 1) / 2)] }'
+}
+
+echo "name,status,compile_s,run_s,peak_rss_kib" > "$RESULTS"
+printf "%-16s %-6s %10s %10s %12s\n" name status compile_s run_s peak_rss_kib
+for src in bench/*.scm; do
+	name=$(basename "$src" .scm)
+	prog=bench/$name
+	compile=$(for i in $(seq "$RUNS"); do
+		$MEASURE -o /dev/null ./schemel "$src" | cut -d' ' -f1
+	done | median)
+	runs=$(for i in $(seq "$RUNS"); do
+		$MEASURE -o "$prog.out" "$prog" 2>/dev/null
+	done)
+	run=$(echo "$runs" | cut -d' ' -f1 | median)
+	rss=$(echo "$runs" | cut -d' ' -f2 | sort -n | tail -n 1)
+	code=$(echo "$runs" | cut -d' ' -f3 | sort -n | tail -n 1)
+	status=ok
+	if [ "$code" != 0 ]; then
+		status=crash
+	elif ! cmp -s "$prog.out" "bench/$name.expected"; then
+		status=wrong
+	fi
+	printf "%-16s %-6s %10s %10s %12s\n" "$name" "$status" "$compile" "$run" "$rss"
+	echo "$name,$status,$compile,$run,$rss" >> "$RESULTS"
+done
@@ -0,0 +1,35 @@
+#!/bin/sh
+## Compile and run synthetic programs of bench/gen-lambdas.sh with each of
+## SIZES lambdas (default 12500 25000 50000 100000) and report the wall
+## time of the parse, emit and build phases, the emit time per lambda,
+## which stays flat when compile time scales linearly, and whether the
+## program displays what it should. Results are also written as CSV to
+## bench/scale.csv, or to $RESULTS.
+cd "$(dirname "$0")/.." || exit 1
+SIZES=${SIZES:-12500 25000 50000 100000}
+DEPTH=${DEPTH:-1000}
+RESULTS=${RESULTS:-bench/scale.csv}
+
+phase() {
+	awk -v p="$1" '$1 == p { print $2 }' bench/scale.report
+}
+
+echo "lambdas,status,parse_s,emit_s,build_s,emit_us_per_lambda" > "$RESULTS"
+printf "%-8s %-6s %10s %10s %10s %14s\n" lambdas status parse_s emit_s build_s emit_us/lambda
+for n in $SIZES; do
+	prog=bench/scale-$n
+	sh bench/gen-lambdas.sh "$n" "$DEPTH" > "$prog.scm"
+	./schemel --time-report "$prog.scm" 2> bench/scale.report
+	parse=$(phase parse)
+	emit=$(phase emit)
+	build=$(phase build)
+	per=$(awk -v e="$emit" -v n="$n" 'BEGIN { printf "%.3f", e * 1e6 / n }')
+	status=ok
+	if [ "$(./$prog)" != "($n $DEPTH 100 300)" ]; then
+		status=wrong
+	fi
+	printf "%-8s %-6s %10s %10s %10s %14s\n" "$n" "$status" "$parse" "$emit" "$build" "$per"
+	echo "$n,$status,$parse,$emit,$build,$per" >> "$RESULTS"
+	rm -f "$prog.scm" "$prog.c" "$prog"
+done
+rm -f bench/scale.report
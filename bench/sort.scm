@@ -0,0 +1,9 @@
+(begin
+  (define table (make-hash-table))
+  (let fill ((i 0))
+    (if (< i 1000000) (begin (hash-table-set! table i i) (fill (+ i 1)))))
+  (define keys (hash-table-keys table))
+  (define up (sort keys <))
+  (define down (sort keys >))
+  (display (list (car keys) (car up) (car down) (length up)))
+)
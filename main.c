@@ -1,22 +1,126 @@
 #include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/resource.h>
 
 #include "runtime.h"
 
+/// Compiler phases timed for --time-report
+enum phases {
+	PREAD = 0,
+	PPARSE,
+	PEMIT,
+	PBUILD,
+	PRUN,
+	PLAST
+};
+static const char *phase_names[PLAST] = { "read", "parse", "emit", "build", "run" };
+static double phase_wall[PLAST] = {0}, phase_cpu[PLAST] = {0};
+static double wall_beg = 0, cpu_beg = 0;
+
+
+static double
+clock_sec(clockid_t clk)
+{
+	struct timespec ts;
+	clock_gettime(clk, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+static void
+phase_begin(void)
+{
+	wall_beg = clock_sec(CLOCK_MONOTONIC);
+	cpu_beg = clock_sec(CLOCK_PROCESS_CPUTIME_ID);
+}
+
+
+static void
+phase_end(int phase)
+{
+	phase_wall[phase] = clock_sec(CLOCK_MONOTONIC) - wall_beg;
+	phase_cpu[phase] = clock_sec(CLOCK_PROCESS_CPUTIME_ID) - cpu_beg;
+}
+
+
+static void
+time_report(size_t ast_nodes)
+{
+	double wall = 0, cpu = 0;
+	struct rusage ru;
+	getrusage(RUSAGE_CHILDREN, &ru);
+	double child_user = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6;
+	double child_sys = ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+	fprintf(stderr, "%-8s %12s %12s\n", "phase", "wall (s)", "cpu (s)");
+	for (int p = 0; p < PLAST; p++) {
+		fprintf(stderr, "%-8s %12.6f %12.6f\n", phase_names[p], phase_wall[p], phase_cpu[p]);
+		wall += phase_wall[p];
+		cpu += phase_cpu[p];
+	}
+	fprintf(stderr, "%-8s %12.6f %12.6f\n", "total", wall, cpu);
+	fprintf(stderr, "child compiler cpu: %.6f s user, %.6f s sys\n", child_user, child_sys);
+	fprintf(stderr, "AST nodes: %zu, lambdas: %zu, units: %zu, emitted bytes: %zu\n",
+		ast_nodes, compile_stats.lambdas, compile_stats.units, compile_stats.emitted_bytes);
+}
+
 
 int
 main(int argc, char *argv[])
 {
 	init_runtime();
-	if (argc == 1) return EXIT_FAILURE;
-	char *file_name = argv[1];
+	options.self = argv[0];
+	int argi = 1;
+	for (; argi < argc && argv[argi][0] == '-'; argi++) {
+		if (strcmp(argv[argi], "--profile") == 0) {
+			options.profile = true;
+		} else if (strcmp(argv[argi], "--alloc-stats") == 0) {
+			options.alloc_stats = true;
+		} else if (strcmp(argv[argi], "--time-report") == 0) {
+			options.time_report = true;
+		} else if (strcmp(argv[argi], "--module") == 0) {
+			options.module = true;
+		} else if (strcmp(argv[argi], "--dump-ir") == 0) {
+			options.dump_ir = true;
+		} else if (strcmp(argv[argi], "--run") == 0) {
+			options.run = true;
+		} else if (strcmp(argv[argi], "--sanitize") == 0) {
+			options.sanitize = true;
+		} else if (strcmp(argv[argi], "--shards") == 0 && argi + 1 < argc) {
+			options.shards = atoi(argv[++argi]);
+		} else {
+			fprintf(stderr, "unknown option '%s'\n", argv[argi]);
+			return EXIT_FAILURE;
+		}
+	}
+	if (argi == argc) return EXIT_FAILURE;
+	char *file_name = argv[argi];
+	phase_begin();
 	char *sexp_str = read_file(file_name);
+	phase_end(PREAD);
+	phase_begin();
 	struct obj *root = gen_obj_list();
 	struct obj *begin = gen_obj_symb("begin");
 	sexp_append_obj_inplace(root, begin);
+	parse_source(file_name, sexp_str);
 	parse(&root, &sexp_str);
+	phase_end(PPARSE);
 	// print_obj(root);
-	emit(file_name, root);
-	build(file_name);
+	if (options.run) {
+		phase_begin();
+		run(file_name, root);
+		phase_end(PRUN);
+	} else {
+		phase_begin();
+		emit(file_name, root);
+		phase_end(PEMIT);
+		phase_begin();
+		build(file_name);
+		if (options.module) write_interface(file_name, root);
+		phase_end(PBUILD);
+	}
+	if (options.time_report) time_report(sexp_count_nodes(root));
     deinit_runtime();
     return EXIT_SUCCESS;
 }
@@ -1,48 +1,472 @@
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <unistd.h>
 #include <gmp.h>
 #include <ctype.h>
 #include <string.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <setjmp.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#if !defined(__x86_64__)
+#include <ucontext.h>
+#endif
 
+#include "runtime.h"
+
+/// stb_ds arrays are accounted in the allocation statistics
+#define STBDS_REALLOC(context, ptr, size) scm_realloc(ptr, size, AK_ARRAY)
+#define STBDS_FREE(context, ptr) scm_free(ptr)
 #define STB_DS_IMPLEMENTATION
 #include <stb/stb_ds.h>
 
-#include "runtime.h"
-
-#define MAX_STACK   (128)
-#define MAX_ENV     (128)
-#define MAX_VALLEN  (128)
-#define MAX_STMTLEN (256)
+#define STACK_MIN   (1024)
 #define FILE_SEP    ('/')
 #define FLOAT_PREC  (128 * 8)
+#define PORT_BUFLEN (64 * 1024)
+#define SANITIZE_FLAGS "-fno-omit-frame-pointer -fsanitize=address,undefined"
+#define HT_MINCAP   (8)
+#define MAX_THREADS (256)
+#define CO_STACK    (1024 * 1024)
+#define SHARD_MIN   (256)
 
-#define panic(...) { fprintf(stderr, __VA_ARGS__); exit(EXIT_FAILURE); }
+#define panic(...) scm_panic(__VA_ARGS__)
 
 /// Forward declarations
-void eval(char ***out, struct obj* ast);
-/// Tree of environment hash tables implemented as an array
+static _Noreturn void scm_panic(const char *fmt, ...);
+static void emit_body(char ***out, struct obj *body, const char *name);
+static void flush_out_port(void);
+static void prof_report(void);
+static void prof_enter(func *fn);
+static uint64_t prof_now(void);
+static unsigned long int new_version(void);
+static int builtin_index(const char *name);
+static bool builtin_pure(int idx);
+static char *chop_file_ext(char *file_name);
+static char *add_suffix(char *file_base, const char *suffix);
+static void prof_leave(void);
+static void alloc_report(void);
+/// Global environment, a hash table. Local variables are C locals of the
+/// compiled lambdas, captured variables are stored in their closures.
+/// Each thread runs on its own stacks and its own global environment,
+/// the main thread on env_main.
 struct envht { char *key; struct obj *value; };
-struct envt { struct envht *e; int pidx; };
-struct envt env[MAX_ENV] = {0};
-static int envmax = 0, envcur_sp = 0;
-static int envcur[MAX_ENV] = {0};
-/// Stack
-static struct obj *stack[MAX_STACK] = {0};
-static int sp = 0;
+struct envt { struct envht *e; unsigned long int version; };
+static struct envt env_main = { .e = NULL, .version = 1 };
+static _Thread_local struct envt *env = &env_main;
+/// Version of the thread's global environment and the last version taken
+_Thread_local unsigned long int global_version = 1;
+static unsigned long int last_version = 1;
+/// Procedure called, until it fetched its captured variables
+static _Thread_local struct obj *cur_closure = NULL;
+/// Stack, grown as needed, of each thread
+static _Thread_local struct obj **stack = NULL;
+static _Thread_local int stack_cap = 0;
+static _Thread_local int sp = 0;
+/// Embedding: a context is an instance of the runtime, with its own
+/// global environment, stack and modules run. A thread calling into a
+/// context makes it current, its state is swapped into the thread's, and
+/// a panic() returns to the call with the error, instead of exiting.
+struct scm_ctx {
+	struct envt env;
+	struct obj **stack;
+	int stack_cap;
+	int sp;
+	struct name_set *modules_run;
+	char *error;
+};
+static _Thread_local struct scm_ctx *cur_ctx = NULL;
+/// Where a panic() on the thread returns to: the API call, or the future
+/// spawned in one, that runs on it, with the generator running and the
+/// stack pointer when it started. The message is left in error.
+struct handler {
+	jmp_buf buf;
+	struct generator *gen;
+	int sp;
+	char *error;
+};
+static _Thread_local struct handler *on_error = NULL;
+/// The compiler's state is shared by all contexts, one thread at a time
+/// parses, lowers and prepares code
+static pthread_mutex_t compile_lock = PTHREAD_MUTEX_INITIALIZER;
+static _Thread_local bool compiling = false;
 /// Lambda
 static int label_idx = 1;
+/// Inline caches of global lookups
+static int cache_idx = 0;
 /// Code
 static char **mainc = NULL;
 static char **funcs = NULL;
 static char **func_decls = NULL;
+/// Set of names, a string hash map that keeps the order they were added in
+struct name_set { char *key; bool value; };
+/// Closure conversion: the parameters and internal definitions of a
+/// lambda are its local variables. The variables of enclosing lambdas it
+/// refers to are captured, copied into the closure when it is created.
+/// Captured variables that are defined or assigned are boxed, so all
+/// closures and the frame defining them share one location. The
+/// variables bound by let, letrec and loops in its body, renamed apart,
+/// are locals too, from let_base on.
+struct scope {
+	struct name_set *locals;
+	bool *local_boxed;
+	bool *local_assigned;
+	ptrdiff_t let_base;
+	char **captured;
+	bool *captured_boxed;
+};
+enum var_kinds {
+	VGLOBAL = 0,
+	VLOCAL,
+	VCAPTURED
+};
 struct func_def {
 	struct obj*parms;
 	struct obj*body;
 	char *name;
-	int lambda_idx;
+	char *src_name;
+	/// Variables captured from the scope the lambda is created in
+	char **captured;
+	bool *captured_boxed;
 };
 struct func_def *func_defs = NULL;
-static int *parent_env = NULL;
+/// Scope of the lambda compiled, NULL at top level
+static struct scope *scope = NULL;
+/// Intermediate representation in A-normal form: the operands of calls,
+/// branches, assignments and closures are atoms, literals, variables and
+/// temporaries, and every other intermediate value is bound to a
+/// temporary by a let, so the order of evaluation is explicit. The body
+/// of every lambda and the top level are lowered to it, optimized and
+/// emitted as C.
+enum ir_kinds {
+	IR_LIT = 0,
+	IR_VAR,
+	IR_TEMP,
+	IR_VOID,
+	IR_QUOTE,
+	IR_CALL,
+	IR_IF,
+	IR_LET,
+	IR_ASSIGN,
+	IR_DISPLAY,
+	IR_IMPORT,
+	IR_LAMBDA,
+	IR_BIND,
+	IR_LOOP,
+	IR_JUMP
+};
+struct ir {
+	int kind;
+	/// Literal or quoted datum
+	struct obj *obj;
+	/// Variable, or variable assigned: name, kind and slot, whether it is
+	/// boxed, refers to the box and can't change while it is in scope.
+	/// Import: initialization function of the module.
+	char *name;
+	int var_kind;
+	ptrdiff_t idx;
+	bool boxed, raw, stable;
+	/// Temporary referred to or bound by a let
+	int temp;
+	/// Call of fn with args, or closure of func_defs[idx] capturing args
+	struct ir *fn;
+	struct ir **args;
+	/// Branch, let binding temp to rhs in body, value assigned, bound or
+	/// displayed
+	struct ir *test, *conseq, *alter;
+	struct ir *rhs, *body;
+	struct ir *value;
+	/// Loop labelled idx binding vars to args, then evaluating body, or
+	/// jump back to loop binding its vars to args
+	struct ir **vars;
+	struct ir *loop;
+	/// Source line it was lowered from, 0 if unknown
+	int line;
+};
+/// Where emitted code leaves a value: on the stack, in a temporary,
+/// declaring it, or nowhere
+enum dests {
+	DPUSH = 0,
+	DTEMP,
+	DDECL,
+	DNONE
+};
+/// In-process interpreter: the optimized IR of the top level and of every
+/// lambda is translated to a tree of code nodes, each with the function
+/// that runs it, chosen for its kind and operands ahead of time. A frame
+/// holds the locals, captured variables and temporaries of a lambda.
+struct frame {
+	struct obj **loc, **fv, **tmp;
+};
+struct code;
+typedef struct obj *(run_fn)(struct code *c, struct frame *f);
+struct code {
+	run_fn *run;
+	/// Literal, or quoted datum printed
+	struct obj *obj;
+	char *datum;
+	/// Variable: kind, slot, temporary or global cache, whether it is
+	/// boxed, name and builtin index of a global. Import: source file.
+	int var_kind;
+	ptrdiff_t idx;
+	bool boxed;
+	char *name;
+	int builtin;
+	/// Operands, branch, let binding temporary idx to rhs in body, value
+	/// assigned, bound or displayed
+	struct code *fn, **args;
+	struct code *test, *conseq, *alter;
+	struct code *rhs, *body, *value;
+	/// Closure of lambda, loop binding vars, or jump back to loop
+	struct code *lambda, **vars, *loop;
+	/// Lambda: number of parameters, locals and temporaries, locals that
+	/// are boxed and where the variables bound by let start
+	ptrdiff_t nparms, nlocals, ntemps, let_base;
+	bool *local_boxed;
+	/// Not a Scheme object: the first captured value of the closures of a
+	/// lambda, referring to its code, or the value of a jump back to a loop
+	struct obj self;
+};
+/// Code of the lambdas in func_defs, the number translated, loops being
+/// translated and modules run
+static struct code **lambda_codes = NULL;
+static ptrdiff_t nprepped = 0;
+static struct { struct ir *key; struct code *value; } *loop_codes = NULL;
+static _Thread_local struct name_set *modules_run = NULL;
+/// Global caches of the interpreter, per thread
+static _Thread_local struct global_cache *run_caches = NULL;
+/// Temporaries of the lambda compiled: their number, uses, atoms
+/// replacing them, lets available for reuse, with the latest available
+/// by hash of the rhs, and temporaries on the stack
+static int ntemps = 0;
+static int *temp_uses = NULL;
+static struct ir **temp_subst = NULL;
+struct cse_entry { struct ir *let; size_t hash; ptrdiff_t prev; };
+static struct cse_entry *cse_avail = NULL;
+static struct { size_t key; ptrdiff_t value; } *cse_latest = NULL;
+static int *pending = NULL;
+/// Globals the program or the modules it imports define or assign
+static struct name_set *assigned_globals = NULL;
+/// Expansion of binding forms: variables renamed, in scope, the number
+/// of renamings, loops and the loops lowered
+struct rename { char *from, *to; };
+static struct rename *renames = NULL;
+static int rename_idx = 0;
+static int loop_idx = 0;
+static struct ir **loops = NULL;
+/// Free variables of lambdas, keyed by their AST
+static struct { struct obj *key; char **value; } *free_vars = NULL;
+/// Locations of the lists parsed from the source given to parse_source,
+/// keyed by their AST. Expansion carries them over to the forms it
+/// rewrites, lowering to the IR nodes, which are emitted under #line
+/// directives, so debuggers, profilers and sanitizers report Scheme lines.
+struct src_loc {
+	const char *file;
+	int line, col;
+};
+static struct { struct obj *key; struct src_loc value; } *src_locs = NULL;
+/// Source parsed, the position lines are counted up to, its line and the
+/// start of the line
+static struct {
+	const char *file;
+	char *beg, *end, *pos, *line_beg;
+	int line;
+} parse_at = {0};
+/// Line of the form lowered, file emitted as a C literal, last line
+/// emitted and the marker of the end of the lines of a function
+static int cur_line = 0;
+static char *emit_src = NULL;
+static int emitted_line = 0;
+static char line_reset[] = "";
+/// Modules: (import name) compiles name.scm, found relative to the
+/// importing file, once into the object file name.o with the interface
+/// name.scmi. The interface lists the module's initialization function,
+/// the modules it imports and the globals it defines. Importing calls the
+/// initialization function, which defines the globals, and links the
+/// object file. Directory of the file compiled, modules it imports and
+/// object files to link with the names of their initialization functions:
+static char *unit_dir = NULL;
+static struct name_set *unit_imports = NULL;
+static char **link_objs = NULL;
+static char **link_inits = NULL;
+/// Translation units of a program, compiled in parallel: the first has
+/// main() and the others only lambdas. They share the header of
+/// declarations, which is NULL when the program is a single unit.
+static char **unit_files = NULL;
+static char *unit_header = NULL;
+/// Modules run in process, keyed by their source file
+static struct { char *key; struct obj *value; } *run_modules = NULL;
+/// Source name of the binding a lambda is defined for, and of the enclosing lambda
+static char *binding_name = NULL;
+static char *cur_src_name = NULL;
+/// Compiler options and statistics
+struct options options = { .profile = false, .alloc_stats = false, .time_report = false,
+	.module = false, .dump_ir = false, .run = false, .sanitize = false, .shards = 0, .self = "schemel" };
+struct compile_stats compile_stats = {0};
+/// Source names of compiled lambdas, keyed by function pointer
+static struct { func *key; const char *value; } *fn_names = NULL;
+/// Function executing, NULL at top level, tracked while profiling or counting allocations.
+/// Only the main thread is traced.
+static _Thread_local func *cur_fn = NULL;
+static _Thread_local bool tracing = false;
+/// Profiler records, keyed by function pointer, and stack of active calls
+struct prof_rec {
+	const char *name;
+	unsigned long int calls;
+	uint64_t incl, excl;
+	int active;
+};
+struct prof_frame {
+	ptrdiff_t rec;
+	uint64_t start, child;
+};
+static struct { func *key; struct prof_rec value; } *prof_tab = NULL;
+static struct prof_frame *prof_stack = NULL;
+static bool prof_enabled = false;
+static uint64_t prof_start = 0;
+/// Allocation statistics by kind and by the function allocating
+struct alloc_stat {
+	unsigned long int count;
+	size_t bytes;
+};
+static struct alloc_stat alloc_by_kind[AK_LAST] = {0};
+struct alloc_fn_stat {
+	func *key;
+	struct alloc_stat value;
+};
+static struct alloc_fn_stat *alloc_by_fn = NULL;
+static size_t heap_live = 0, heap_peak = 0;
+static bool alloc_enabled = false, alloc_json = false;
+/// Worker threads are not accounted, they run permanently busy
+static _Thread_local bool alloc_busy = false;
+static const char *alloc_kind_names[AK_LAST] = {
+	"bool", "number", "symbol", "list", "function", "hash-table", "string", "future",
+	"generator", "eof", "box", "port", "promise", "array", "bignum"
+};
+/// Hash tables with open addressing and linear probing.
+/// Empty slots have a NULL key, deleted slots the tombstone key.
+struct htslot {
+	struct obj *key;
+	struct obj *value;
+	size_t hash;
+};
+struct hashtable {
+	struct htslot *slots;
+	size_t cap, count, used;
+};
+static struct obj ht_tombstone = { .type = TLAST };
+/// Strings are immutable views into a shared buffer. Appending to a
+/// string that ends at the end of its buffer extends the buffer in place,
+/// so building a string by repeated appends is amortized linear.
+/// Buffers never move and their len only grows, by atomic claims.
+/// A buffer with cap 0 is static storage and never written to.
+struct strbuf {
+	char *data;
+	size_t len, cap;
+};
+struct string {
+	struct strbuf *buf;
+	size_t off, len;
+};
+/// Futures run on a pool of worker threads. Every thread has a deque of
+/// futures, its owner pushes and pops at the tail and idle workers steal
+/// from the head. A future runs in a snapshot of the global environment
+/// taken when it is created, so its bindings don't race with other threads.
+enum future_states {
+	FPENDING = 0,
+	FRUNNING,
+	FDONE
+};
+struct future {
+	struct obj *thunk;
+	/// Chunk of pmap: map proc over nitems items instead of calling thunk
+	struct obj *proc;
+	struct obj **items;
+	size_t nitems;
+	struct envt *env;
+	struct obj *value;
+	/// Spawned in an API call, a panic() while running is its error,
+	/// raised again where it is touched
+	bool caught;
+	char *error;
+	int state;
+	pthread_mutex_t lock;
+	pthread_cond_t done;
+};
+struct deque {
+	struct future **tasks;
+	size_t head;
+	pthread_mutex_t lock;
+};
+static struct deque deques[MAX_THREADS];
+static int nthreads = 0;
+static _Thread_local int thread_id = 0;
+static int pool_pending = 0;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_cv = PTHREAD_COND_INITIALIZER;
+/// Generators run as coroutines on their own C stacks, switched in user
+/// space. A stack is reserved but only committed as it is touched, so it
+/// starts at a page and grows on demand. While a generator is suspended
+/// its part of the VM stacks is saved and restored above the resumer's.
+#if defined(__x86_64__)
+typedef void *coctx;
+#else
+typedef ucontext_t coctx;
+#endif
+enum generator_states {
+	GNEW = 0,
+	GSUSPENDED,
+	GRUNNING,
+	GDONE
+};
+struct generator {
+	struct obj *thunk;
+	coctx ctx, caller;
+	char *cstack;
+	/// Saved VM stack segments and their base in the resumer's stacks
+	struct obj **vals;
+	struct prof_frame *frames;
+	int sp_base;
+	ptrdiff_t prof_base;
+	/// Profiler clock when last resumed and suspended, cycles charged to resumers
+	uint64_t resumed, suspended, charged;
+	struct obj *value;
+	int state;
+	struct generator *resumer;
+};
+static _Thread_local struct generator *gen_cur = NULL;
+/// Generators a panic() left, their stacks are unmapped once it returned
+static _Thread_local struct generator **gen_abandoned = NULL;
+static struct obj eof_obj = { .type = TEOF };
+/// Ports
+struct port out_port = { .f = NULL, .buf = NULL };
+static pthread_mutex_t out_lock = PTHREAD_MUTEX_INITIALIZER;
+/// Buffered input port, reading a file in blocks of PORT_BUFLEN bytes.
+/// The bytes from pos to len are not consumed yet and are followed by a
+/// NUL, so the lexer can run on them. fd is -1 once the port is closed.
+struct in_port {
+	int fd;
+	char *buf;
+	size_t pos, len, cap;
+	bool eof;
+};
+static struct in_port stdin_port = { .fd = 0 };
+/// Promises hold their thunk until forced, then their value
+struct promise {
+	struct obj *thunk;
+	struct obj *value;
+	bool done;
+};
 
 
 /// Functions operating on objects/s-expressions
@@ -56,6 +480,19 @@ sexp_append_obj_inplace(struct obj *list, struct obj *obj)
 }
 
 
+size_t
+sexp_count_nodes(struct obj *obj)
+{
+	if (!obj) return 0;
+	size_t ret = 1;
+	if (obj->type == TLIST) {
+		struct obj **darr = obj->pval;
+		for (size_t i = 0; i < arrlenu(darr); i++) ret += sexp_count_nodes(darr[i]);
+	}
+	return ret;
+}
+
+
 void
 sexp_append_or_set(struct obj **out, struct obj *obj)
 {
@@ -66,10 +503,25 @@ sexp_append_or_set(struct obj **out, struct obj *obj)
 
 
 /// String operations, lexer, parser
-void
-str_from_strview(char *s, struct strview sv)
+static char *
+str_from_strview(struct strview sv)
 {
-	snprintf(s, sv.end - sv.beg + 1 + 1, "%s", sv.beg);
+	return strndup(sv.beg, sv.end - sv.beg + 1);
+}
+
+
+static char *
+str_fmt(const char *fmt, ...)
+{
+	va_list ap;
+	va_start(ap, fmt);
+	int len = vsnprintf(NULL, 0, fmt, ap);
+	va_end(ap);
+	char *s = malloc(len + 1);
+	va_start(ap, fmt);
+	vsnprintf(s, len + 1, fmt, ap);
+	va_end(ap);
+	return s;
 }
 
 
@@ -122,6 +574,19 @@ next_tok(char **ss)
 		t.type = TOKPARR;
 		t.s = (struct strview){ .beg = *ss, .end = *ss };
 		(*ss)++;
+	} else if (c == '"') {
+		/// The token is the string content without the quotes,
+		/// escape sequences are resolved by the parser
+		t.type = TOKSTR;
+		(*ss)++;
+		t.s = (struct strview){ .beg = *ss };
+		while (**ss && **ss != '"') {
+			if (**ss == '\\' && *(*ss + 1)) (*ss)++;
+			(*ss)++;
+		}
+		if (**ss != '"') panic("unterminated string literal\n");
+		t.s.end = *ss - 1;
+		(*ss)++;
 	} else if (isdigit(c)
 		|| (*(*ss + 1) && isdigit(*(*ss + 1)) && (c == '+' || c == '-'))) {
 		t.type = TOKNUM;
@@ -132,27 +597,53 @@ next_tok(char **ss)
 	} else {
 		t.type = TOKSYMB;
 		t.s = (struct strview){ .beg = *ss };
-		while (!isspace(**ss) && **ss != '(' && **ss != ')') (*ss)++;
+		while (**ss && !isspace(**ss) && **ss != '(' && **ss != ')' && **ss != '"') (*ss)++;
 		t.s.end = *ss - 1;
 	}
 	return t;
 }
 
 
+void
+parse_source(const char *file_name, char *src)
+{
+	parse_at.file = file_name;
+	parse_at.beg = parse_at.pos = parse_at.line_beg = src;
+	parse_at.end = src + strlen(src);
+	parse_at.line = 1;
+}
+
+
+/// Records that list starts at at, if that is in the source
+static void
+record_loc(struct obj *list, char *at)
+{
+	if (at < parse_at.beg || at >= parse_at.end || at < parse_at.pos) return;
+	for (; parse_at.pos < at; parse_at.pos++) {
+		if (*parse_at.pos != '\n') continue;
+		parse_at.line++;
+		parse_at.line_beg = parse_at.pos + 1;
+	}
+	struct src_loc loc = { .file = parse_at.file, .line = parse_at.line, .col = at - parse_at.line_beg + 1 };
+	hmput(src_locs, list, loc);
+}
+
+
 int
 parse(struct obj **ast, char **sexpr_str)
 {
 	struct token t;
-	char buf[MAX_VALLEN];
 	t = next_tok(sexpr_str);
 	int t_type = t.type;
 	if (t_type == TOKEOS) {
 	}
 	else if (t_type == TOKPARL) {
 		struct obj *o = gen_obj_list();
+		record_loc(o, t.s.beg);
 		int t_type;
 		do {
 			t_type = parse(&o, sexpr_str);
+			if (t_type == TOKEOS) panic("missing ')' at the end of the source\n");
 		} while (t_type != TOKPARR);
 		sexp_append_or_set(ast, o);
 	}
@@ -163,8 +654,25 @@ parse(struct obj **ast, char **sexpr_str)
 		sexp_append_or_set(ast, o);
 	}
 	else if (t_type == TOKSYMB) {
-		str_from_strview(buf, t.s);
-		struct obj *o = gen_obj_symb(buf);
+		char *name = str_from_strview(t.s);
+		struct obj *o = gen_obj_symb(name);
+		free(name);
+		sexp_append_or_set(ast, o);
+	}
+	else if (t_type == TOKSTR) {
+		char *str = malloc(t.s.end - t.s.beg + 1);
+		size_t len = 0;
+		for (char *c = t.s.beg; c <= t.s.end; c++) {
+			if (*c == '\\') {
+				c++;
+				if (*c == 'n') str[len++] = '\n';
+				else if (*c == 't') str[len++] = '\t';
+				else str[len++] = *c;
+			} else {
+				str[len++] = *c;
+			}
+		}
+		struct obj *o = gen_obj_str(str, len);
 		sexp_append_or_set(ast, o);
 	}
 	else {
@@ -175,441 +683,3135 @@ parse(struct obj **ast, char **sexpr_str)
 
 
 static void
-emit_incl(char ***out)
-{
-	char **outarr = *out;
-	arrput(outarr,
-		"#include <stdlib.h>\n"
-		"#include \"runtime.h\"\n\n"
-	);
-	*out = outarr;
-}
-
-
-static void
-emit_main_top(char ***out)
+add_name(struct name_set **names, char *name)
 {
-	char **outarr = *out;
-	arrput(outarr,
-		"int\n"
-		"main(int argc, char *argv[])\n"
-		"{\n"
-		"	int ret = EXIT_FAILURE;\n"
-		"	init_runtime();\n"
-	);
-	*out = outarr;
+	if (shgeti(*names, name) < 0) shput(*names, name, true);
 }
 
 
-static void
-emit_main_bottom(char ***out)
+static bool
+has_name(struct name_set *names, char *name)
 {
-	char **outarr = *out;
-	arrput(outarr,
-		"	ret = EXIT_SUCCESS;\n"
-		"	deinit_runtime();\n"
-		"	return ret;\n"
-		"}\n"
-	);
-	*out = outarr;
+	return shgeti(names, name) >= 0;
 }
 
 
-static void
-emit_display(char ***out)
+static bool
+is_form(struct obj **x, const char *symb)
 {
-	char **outarr = *out;
-	arrput(outarr,
-		"	print_obj(pop());\n"
-		"	push(NULL);\n"
-	);
-	*out = outarr;
+	return x[0]->type == TSYMB && strcmp(x[0]->pval, symb) == 0;
 }
 
 
-static void
-emit_literal(char ***out, struct obj *obj)
+/// Index of the first subexpression of a form or call to walk, binding
+/// lists and operators that aren't symbols are walked too
+static ptrdiff_t
+first_subexpr(struct obj **x)
 {
-	char **outarr = *out;
-	char s[MAX_VALLEN];
-	obj_tostr(s, obj);
-	char *so = malloc(MAX_STMTLEN);
-	sprintf(so, "	push(gen_obj_int(%s));\n", s);
-	arrput(outarr, so);
-	*out = outarr;
+	return x[0]->type == TSYMB ? 1 : 0;
 }
 
 
+/// Names defined in a lambda body, not in the lambdas nested in it
 static void
-emit_retrieve(char ***out, struct obj *obj)
+collect_defines(struct obj *ast, struct name_set **names)
 {
-	char **outarr = *out;
-	char s[MAX_VALLEN];
-	obj_tostr(s, obj);
-	char *so = malloc(MAX_STMTLEN);
-	sprintf(so, "	push(retrieve_symbol(\"%s\"));\n", (char *)obj->pval);
-	arrput(outarr, so);
-	*out = outarr;
+	if (ast->type != TLIST || arrlen((struct obj **)ast->pval) == 0) return;
+	struct obj **x = ast->pval;
+	if (is_form(x, "quote") || is_form(x, "lambda") || is_form(x, "future")) return;
+	if (is_form(x, "define")) add_name(names, x[1]->pval);
+	for (ptrdiff_t i = first_subexpr(x); i < arrlen(x); i++) collect_defines(x[i], names);
 }
 
 
+/// Names bound by let, letrec and loops in a lambda body, or only by letrec
 static void
-emit_call(char ***out, struct obj *obj, size_t narg)
+collect_bindings(struct obj *ast, struct name_set **names, bool letrec_only)
 {
-	char **outarr = *out;
-	char s[MAX_VALLEN];
-	obj_tostr(s, obj);
-	char *so = malloc(MAX_STMTLEN);
-	sprintf(so, "	call_obj(retrieve_symbol(\"%s\"), %ld);\n", (char *)obj->pval, narg);
-	arrput(outarr, so);
-	*out = outarr;
+	if (ast->type != TLIST || arrlen((struct obj **)ast->pval) == 0) return;
+	struct obj **x = ast->pval;
+	if (is_form(x, "quote") || is_form(x, "lambda") || is_form(x, "future")) return;
+	if (is_form(x, "letrec") || (!letrec_only && (is_form(x, "let") || is_form(x, "%loop")))) {
+		struct obj **b = x[arrlen(x) - 2]->pval;
+		for (ptrdiff_t i = 0; i < arrlen(b); i++) add_name(names, ((struct obj **)b[i]->pval)[0]->pval);
+	}
+	for (ptrdiff_t i = first_subexpr(x); i < arrlen(x); i++) collect_bindings(x[i], names, letrec_only);
 }
 
 
+/// Names assigned with set! anywhere in ast
 static void
-emit_call_obj(char ***out, int argc)
+collect_sets(struct obj *ast, struct name_set **names)
 {
-	char **outarr = *out;
-	char *so = malloc(MAX_STMTLEN);
-	sprintf(so, "	call_obj(pop(), %d);\n", argc);
-	arrput(outarr, so);
-	*out = outarr;
+	if (ast->type != TLIST || arrlen((struct obj **)ast->pval) == 0) return;
+	struct obj **x = ast->pval;
+	if (is_form(x, "quote")) return;
+	if (is_form(x, "set!")) add_name(names, x[1]->pval);
+	for (ptrdiff_t i = first_subexpr(x); i < arrlen(x); i++) collect_sets(x[i], names);
 }
 
 
+/// Names defined or assigned anywhere in ast
 static void
-emit_if(char ***out, struct obj *conseq, struct obj *alter)
+collect_assigned(struct obj *ast, struct name_set **names)
 {
-	char **outarr = *out;
-	arrput(outarr, "	if (is_true(pop())) {\n");
-	*out = outarr;
-	eval(out, conseq);
-	outarr = *out;
-	arrput(outarr, "	} else {\n");
-	*out = outarr;
-	eval(out, alter);
-	outarr = *out;
-	arrput(outarr, "	}\n");
-	*out = outarr;
+	if (ast->type != TLIST || arrlen((struct obj **)ast->pval) == 0) return;
+	struct obj **x = ast->pval;
+	if (is_form(x, "quote")) return;
+	if (is_form(x, "define") || is_form(x, "set!")) add_name(names, x[1]->pval);
+	for (ptrdiff_t i = first_subexpr(x); i < arrlen(x); i++) collect_assigned(x[i], names);
 }
 
 
-static void
-emit_define(char ***out, struct obj *obj)
-{
-	char **outarr = *out;
-	char s[MAX_VALLEN];
-	obj_tostr(s, obj);
-	char *so = malloc(MAX_STMTLEN);
-	sprintf(so, "	define_local(pop(), \"%s\");", (char *)obj->pval);
-	arrput(outarr, so);
-	arrput(outarr, "	push(NULL);\n");
-	*out = outarr;
-}
+static char **lambda_free_vars(struct obj *ast);
+static char **body_free_vars(struct obj *parms, struct obj *body);
 
 
+/// Names referred to in ast, or only those referred to by nested lambdas
 static void
-emit_set(char ***out, struct obj *obj)
+collect_refs(struct obj *ast, struct name_set **names, bool nested_only)
 {
-	char **outarr = *out;
-	char s[MAX_VALLEN];
-	obj_tostr(s, obj);
-	char *so = malloc(MAX_STMTLEN);
-	sprintf(so, "	define_global(pop(), \"%s\");", (char *)obj->pval);
-	arrput(outarr, so);
-	arrput(outarr, "	push(NULL);\n");
-	*out = outarr;
+	if (ast->type == TSYMB && !nested_only) add_name(names, ast->pval);
+	if (ast->type != TLIST || arrlen((struct obj **)ast->pval) == 0) return;
+	struct obj **x = ast->pval;
+	ptrdiff_t beg = 0;
+	if (is_form(x, "quote")) {
+		return;
+	} else if (is_form(x, "lambda")) {
+		char **fv = lambda_free_vars(ast);
+		for (ptrdiff_t i = 0; i < arrlen(fv); i++) add_name(names, fv[i]);
+		return;
+	} else if (is_form(x, "future")) {
+		char **fv = body_free_vars(NULL, x[1]);
+		for (ptrdiff_t i = 0; i < arrlen(fv); i++) add_name(names, fv[i]);
+		arrfree(fv);
+		return;
+	} else if (is_form(x, "let") || is_form(x, "letrec") || is_form(x, "%loop")) {
+		/// The inits and the body
+		struct obj **b = x[arrlen(x) - 2]->pval;
+		for (ptrdiff_t i = 0; i < arrlen(b); i++) {
+			collect_refs(((struct obj **)b[i]->pval)[1], names, nested_only);
+		}
+		collect_refs(x[arrlen(x) - 1], names, nested_only);
+		return;
+	} else if (is_form(x, "define")) {
+		beg = 2;
+	} else if (is_form(x, "if") || is_form(x, "begin") || is_form(x, "display")
+			|| is_form(x, "set!")) {
+		beg = 1;
+	}
+	for (ptrdiff_t i = beg; i < arrlen(x); i++) collect_refs(x[i], names, nested_only);
 }
 
 
-static void
-emit_pop(char ***out)
+static char **
+body_free_vars(struct obj *parms, struct obj *body)
 {
-	char **outarr = *out;
-	arrput(outarr, "	pop();\n");
-	*out = outarr;
+	struct name_set *bound = NULL, *refs = NULL;
+	char **fv = NULL;
+	struct obj **parr = parms ? parms->pval : NULL;
+	for (ptrdiff_t i = 0; i < arrlen(parr); i++) add_name(&bound, parr[i]->pval);
+	collect_defines(body, &bound);
+	collect_bindings(body, &bound, false);
+	collect_refs(body, &refs, false);
+	for (ptrdiff_t i = 0; i < shlen(refs); i++) {
+		if (!has_name(bound, refs[i].key)) arrput(fv, refs[i].key);
+	}
+	shfree(bound);
+	shfree(refs);
+	return fv;
 }
 
 
-static void
-emit_lambda_obj(char ***out, char *name, int env_idx)
+static char **
+lambda_free_vars(struct obj *ast)
 {
-	char **outarr = *out;
-	char *so = malloc(MAX_STMTLEN);
-	sprintf(so, "	push(gen_obj_fn(%s, %d));\n", name, env_idx);
-	arrput(outarr, so);
-	*out = outarr;
+	ptrdiff_t idx = hmgeti(free_vars, ast);
+	if (idx >= 0) return free_vars[idx].value;
+	struct obj **x = ast->pval;
+	char **fv = body_free_vars(x[1], x[2]);
+	hmput(free_vars, ast, fv);
+	return fv;
 }
 
 
-static void
-emit_env(char ***out, int env_idx, int parent_env_idx)
+/// Scope of a lambda, or of the top level, where definitions are globals
+static struct scope *
+new_scope(struct func_def *fd, bool top)
 {
-	char **outarr = *out;
-	char *so = malloc(MAX_STMTLEN);
-	sprintf(so, "	new_env(%d, %d);\n", env_idx, parent_env_idx);
-	arrput(outarr, so);
-	*out = outarr;
+	struct scope *sc = calloc(1, sizeof(struct scope));
+	struct obj **parr = fd->parms->pval;
+	for (ptrdiff_t i = 0; i < arrlen(parr); i++) add_name(&sc->locals, parr[i]->pval);
+	if (!top) collect_defines(fd->body, &sc->locals);
+	sc->let_base = shlen(sc->locals);
+	collect_bindings(fd->body, &sc->locals, false);
+	/// Box the locals that nested lambdas capture and that are (re)defined
+	struct name_set *nested = NULL, *assigned = NULL;
+	collect_refs(fd->body, &nested, true);
+	collect_defines(fd->body, &assigned);
+	collect_sets(fd->body, &assigned);
+	collect_bindings(fd->body, &assigned, true);
+	for (ptrdiff_t i = 0; i < shlen(sc->locals); i++) {
+		char *local = sc->locals[i].key;
+		arrput(sc->local_boxed, has_name(nested, local) && has_name(assigned, local));
+		arrput(sc->local_assigned, has_name(assigned, local));
+	}
+	shfree(nested);
+	shfree(assigned);
+	sc->captured = fd->captured;
+	sc->captured_boxed = fd->captured_boxed;
+	return sc;
 }
 
 
-static void
-emit_lambda_decl(char ***out, char *name)
+/// Expansion of the binding forms. The variables bound by let, let*,
+/// letrec and named let are renamed apart, to name%n, so they are locals
+/// of the enclosing lambda, or of the top level. let* is expanded to
+/// nested lets, do to a named let. A named let whose name is only called
+/// in tail position becomes a loop, (%loop name ((var init) ...) body),
+/// other named lets a recursive lambda bound by letrec.
+static struct obj *
+sexp_list(int n, ...)
 {
-	char **outarr = *out;
-	char *so = malloc(MAX_STMTLEN);
-	sprintf(so, "void %s(int nargs);\n", name);
-	arrput(outarr, so);
-	*out = outarr;
+	struct obj *list = gen_obj_list();
+	va_list ap;
+	va_start(ap, n);
+	for (int i = 0; i < n; i++) sexp_append_obj_inplace(list, va_arg(ap, struct obj *));
+	va_end(ap);
+	return list;
 }
 
 
-static void
-emit_lambda_def(char ***out, struct func_def *fd)
+static char *
+rename_var(char *name)
 {
-	/// Generate function definition outside of main() by
-	/// generating code to add the parms to the runtime environment of the function
-	char **outarr = *out;
-	char *so = malloc(MAX_STMTLEN);
-	sprintf(so, "void %s(int nargs)\n", fd->name);
-	arrput(outarr, so);
-	arrput(outarr, "{\n");
-	struct obj **parr = fd->parms->pval;
-	for (ptrdiff_t i = arrlen(parr) - 1; i >= 0; i--) {
-		struct obj *parm = parr[i];
-		char *so = malloc(MAX_STMTLEN);
-		sprintf(so, "	define_local(pop(), \"%s\");\n", (char *)parm->pval);
-		arrput(outarr, so);
-	}
-	/// Generate code for the function body
-	arrput(parent_env, fd->lambda_idx);
-	*out = outarr;
-	eval(out, fd->body);
-	outarr = *out;
-	arrpop(parent_env);
-	arrput(outarr, "}\n");
-	*out = outarr;
+	char *to = str_fmt("%s%%%d", name, rename_idx++);
+	struct rename r = { .from = name, .to = to };
+	arrput(renames, r);
+	return to;
 }
 
 
-static void
-emit_quote(char ***out, struct obj *obj)
+/// Source name of a renamed variable
+static char *
+src_var_name(char *name)
 {
-	char **outarr = *out;
-	char *so = malloc(MAX_STMTLEN);
-	char val_s[MAX_VALLEN] = {0};
-	obj_tostr(val_s, obj);
-	sprintf(so, "	QUOTE(\"%s\");\n", val_s);
-	arrput(outarr, so);
-	*out = outarr;
+	return strndup(name, strcspn(name, "%"));
 }
 
 
-void
-eval_list(char ***out, struct obj **list, ptrdiff_t beg, ptrdiff_t end)
+/// Whether name is only called in tail position in ast, and not referred
+/// to otherwise
+static bool
+only_tail_calls(struct obj *ast, char *name, bool tail)
 {
-	if (end == -1) end = arrlen(list) - 1;
-	else if (end > arrlen(list) - 1) return;
-	for (ptrdiff_t i = beg; i <= end; i++) {
-		eval(out, list[i]);
+	if (ast->type == TSYMB) return strcmp(ast->pval, name) != 0;
+	if (ast->type != TLIST || arrlen((struct obj **)ast->pval) == 0) return true;
+	struct obj **x = ast->pval;
+	ptrdiff_t n = arrlen(x);
+	if (is_form(x, "quote")) return true;
+	if (is_form(x, "if")) {
+		return only_tail_calls(x[1], name, false) && only_tail_calls(x[2], name, tail)
+			&& (n < 4 || only_tail_calls(x[3], name, tail));
 	}
-}
-
-
-void
-eval(char ***out, struct obj* ast)
-{
-	if (ast->type == TLIST) {
-		struct obj **x = ast->pval;
-		struct obj *fo = x[0];
-		if (fo->type == TSYMB) {
-			char *symb = fo->pval;
-			if (strcmp(symb, "quote") == 0) {
-				emit_quote(out, x[1]);
-			} else if (strcmp(symb, "if") == 0) {
-				eval(out, x[1]);
-				emit_if(out, x[2], x[3]);
-			} else if (strcmp(symb, "define") == 0) {
-				eval(out, x[2]);
-				emit_define(out, x[1]);
-			} else if (strcmp(symb, "set!") == 0) {
-				/// FIXME maybe incorrect, could also be set in an enclosing scope,
-				/// not necessarily the global scope
-				eval(out, x[2]);
-				emit_set(out, x[1]);
-			} else if (strcmp(symb, "begin") == 0) {
-				size_t i;
-				for (i = 1; i < arrlenu(x) - 1; i++) {
-					eval(out, x[i]);
-					emit_pop(out);
-				}
-				eval(out, x[i]);
-			} else if (strcmp(symb, "display") == 0) {
-				eval(out, x[1]);
-				emit_display(out);
-			} else if (strcmp(symb, "lambda") == 0) {
-				char *lambda_name = malloc(MAX_VALLEN);
-				sprintf(lambda_name, "lambda_%d", label_idx);
-				int env_idx = label_idx;
-				label_idx++;
-				struct func_def fd = {
-					.parms = x[1],
-					.body = x[2],
-					.name = lambda_name,
-					.lambda_idx = env_idx
-				};
-				arrput(func_defs, fd);
-				emit_lambda_obj(out, lambda_name, env_idx);
-				/// Generate lambda object with its newly created environment index
-				/// and also a new environment with the env_idx 
-				size_t last_parenv = parent_env[arrlenu(parent_env) - 1];
-				emit_env(out, env_idx, last_parenv);
-			} else {  /// Function call (proc arg ...)
-				eval_list(out, x, 1, -1);
-				emit_call(out, fo, arrlenu(x) - 1);
-			}
-		} else if (fo->type == TLIST) {  /// Function call ((proc ...) arg ...)
-			eval_list(out, x, 1, -1);
-			eval(out, x[0]);
-			emit_call_obj(out, arrlenu(x) - 1);
+	if (is_form(x, "begin")) {
+		for (ptrdiff_t i = 1; i < n - 1; i++) {
+			if (!only_tail_calls(x[i], name, false)) return false;
 		}
-	} else if (ast->type == TSYMB) {  /// Variable reference
-		emit_retrieve(out, ast);
-	} else if (ast->type == TNUM) {  /// Constant literal
-		/// TODO differ between integer and float (use multiprecision library?)
-		///      ... and character literals ...?
-		emit_literal(out, ast);
+		return n < 2 || only_tail_calls(x[n - 1], name, tail);
 	}
+	if (is_form(x, "let") || is_form(x, "letrec") || is_form(x, "%loop")) {
+		struct obj **b = x[n - 2]->pval;
+		for (ptrdiff_t i = 0; i < arrlen(b); i++) {
+			if (!only_tail_calls(((struct obj **)b[i]->pval)[1], name, false)) return false;
+		}
+		return only_tail_calls(x[n - 1], name, tail);
+	}
+	if (x[0]->type == TSYMB && strcmp(x[0]->pval, name) == 0 && !tail) return false;
+	for (ptrdiff_t i = x[0]->type == TSYMB ? 1 : 0; i < n; i++) {
+		if (!only_tail_calls(x[i], name, false)) return false;
+	}
+	return true;
 }
 
 
-static char *
-chop_file_ext(char *file_name)
-{
-	char *dot = strrchr(file_name, '.');
-	char *slash = strrchr(file_name, FILE_SEP);
-	if (!dot || dot < slash) return file_name;
-	char *ret = malloc(dot - file_name + 1);
-	memcpy(ret, file_name, dot - file_name);
-	ret[dot - file_name] = '\0';
-	return ret;
-}
+static struct obj *expand(struct obj *ast);
 
 
-static char *
-add_suffix(char *file_base, const char *suffix)
+/// Body of expressions x[beg], ..., a begin if there are several
+static struct obj *
+expand_body(struct obj **x, ptrdiff_t beg)
 {
-	size_t file_base_len = strlen(file_base);
-    char *out_file = realloc(file_base, file_base_len + 2);
-    sprintf(out_file, "%s%s", file_base, suffix);
-    return out_file;
+	if (arrlen(x) - beg == 1) return expand(x[beg]);
+	struct obj *body = sexp_list(1, gen_obj_symb("begin"));
+	for (ptrdiff_t i = beg; i < arrlen(x); i++) sexp_append_obj_inplace(body, expand(x[i]));
+	return body;
 }
 
 
-void
-emit(char *file_name, struct obj* ast)
+static struct obj *
+expand_let(struct obj **x, bool sequential)
 {
-	char *file_base = chop_file_ext(file_name);
-	if (!file_base) return;
-    FILE *f = fopen(add_suffix(file_base, ".c"), "w");
-	emit_incl(&funcs);
-	emit_main_top(&mainc);
-	eval(&mainc, ast);
-	emit_main_bottom(&mainc);
-	for (size_t i = 0; i < arrlenu(func_defs); i++) {
-		emit_lambda_def(&funcs, &func_defs[i]);
-	}
-	for (size_t i = 0; i < arrlenu(func_defs); i++) {
-		emit_lambda_decl(&func_decls, func_defs[i].name);
+	/// The inits of let are expanded outside the scope of its variables,
+	/// each init of let* in the scope of the variables before it
+	struct obj **b = x[1]->pval;
+	struct obj **vars = NULL, **inits = NULL;
+	for (ptrdiff_t i = 0; i < arrlen(b); i++) {
+		struct obj **pair = b[i]->pval;
+		arrput(inits, expand(pair[1]));
+		if (sequential) arrput(vars, gen_obj_symb(rename_var(pair[0]->pval)));
 	}
-	for (size_t i = 0; i < arrlenu(func_decls); i++) {
-		fputs(func_decls[i], f);
+	for (ptrdiff_t i = 0; !sequential && i < arrlen(b); i++) {
+		arrput(vars, gen_obj_symb(rename_var(((struct obj **)b[i]->pval)[0]->pval)));
 	}
-	for (size_t i = 0; i < arrlenu(funcs); i++) {
-		fputs(funcs[i], f);
-	}
-	for (size_t i = 0; i < arrlenu(mainc); i++) {
-		fputs(mainc[i], f);
+	struct obj *body = expand_body(x, 2);
+	for (ptrdiff_t i = arrlen(vars) - 1; i >= 0; i--) {
+		if (!sequential && i > 0) continue;
+		struct obj *bl = gen_obj_list();
+		for (ptrdiff_t j = i; j < (sequential ? i + 1 : arrlen(vars)); j++) {
+			sexp_append_obj_inplace(bl, sexp_list(2, vars[j], inits[j]));
+		}
+		body = sexp_list(3, gen_obj_symb("let"), bl, body);
 	}
-	fclose(f);
+	arrfree(vars);
+	arrfree(inits);
+	return body;
 }
 
 
-void
-build(char *file_name)
+static struct obj *
+expand_letrec(struct obj **x)
 {
-	char *file_base = chop_file_ext(file_name);
-	char cmd[MAX_STMTLEN];
-	sprintf(cmd, "cc -g -I. -o %s %s.c runtime.o -lgmp", file_base, file_base);
-	system("make");
-	system(cmd);
+	struct obj **b = x[1]->pval;
+	struct obj *bl = gen_obj_list();
+	char **vars = NULL;
+	for (ptrdiff_t i = 0; i < arrlen(b); i++) {
+		arrput(vars, rename_var(((struct obj **)b[i]->pval)[0]->pval));
+	}
+	for (ptrdiff_t i = 0; i < arrlen(b); i++) {
+		struct obj *init = expand(((struct obj **)b[i]->pval)[1]);
+		sexp_append_obj_inplace(bl, sexp_list(2, gen_obj_symb(vars[i]), init));
+	}
+	arrfree(vars);
+	return sexp_list(3, gen_obj_symb("letrec"), bl, expand_body(x, 2));
 }
 
 
-/// Functions for generating objects
-
-struct obj *
-gen_obj_bool(bool op)
+static struct obj *
+expand_named_let(struct obj **x)
 {
-	struct obj *res = malloc(sizeof(struct obj));
-	res->type = TBOOL;
-	res->pval = malloc(sizeof(bool));
-	res->envidx = 0;
-	*(bool *)res->pval = op;
+	struct obj **b = x[2]->pval;
+	struct obj **inits = NULL;
+	for (ptrdiff_t i = 0; i < arrlen(b); i++) arrput(inits, expand(((struct obj **)b[i]->pval)[1]));
+	struct obj *name = gen_obj_symb(rename_var(x[1]->pval));
+	struct obj *parms = gen_obj_list();
+	for (ptrdiff_t i = 0; i < arrlen(b); i++) {
+		char *var = rename_var(((struct obj **)b[i]->pval)[0]->pval);
+		sexp_append_obj_inplace(parms, gen_obj_symb(var));
+	}
+	struct obj *body = expand_body(x, 3);
+	struct obj *res;
+	if (only_tail_calls(body, name->pval, true)) {
+		struct obj *bl = gen_obj_list();
+		for (ptrdiff_t i = 0; i < arrlen(inits); i++) {
+			sexp_append_obj_inplace(bl, sexp_list(2, ((struct obj **)parms->pval)[i], inits[i]));
+		}
+		res = sexp_list(4, gen_obj_symb("%loop"), name, bl, body);
+	} else {
+		/// ((letrec ((name (lambda (var ...) body))) name) init ...)
+		struct obj *lambda = sexp_list(3, gen_obj_symb("lambda"), parms, body);
+		struct obj *bl = sexp_list(1, sexp_list(2, name, lambda));
+		res = sexp_list(1, sexp_list(3, gen_obj_symb("letrec"), bl, name));
+		for (ptrdiff_t i = 0; i < arrlen(inits); i++) sexp_append_obj_inplace(res, inits[i]);
+	}
+	arrfree(inits);
 	return res;
 }
 
 
-struct obj *
-gen_obj_int(long int op)
+/// (do ((var init step) ...) (test expr ...) command ...) is
+/// (let %do ((var init) ...)
+///   (if test (begin expr ...) (begin command ... (%do step ...))))
+static struct obj *
+do_to_named_let(struct obj **x)
 {
-	struct obj *res = malloc(sizeof(struct obj));
-	res->type = TNUM;
-	res->pval = malloc(sizeof(mpf_t));
-	res->envidx = 0;
-	if (op >= 0) {
-		mpf_init_set_ui(res->pval, op);
-	} else {
-		mpf_init_set_si(res->pval, op);
+	struct obj *loop = gen_obj_symb("%do");
+	struct obj **specs = x[1]->pval, **exit = x[2]->pval;
+	struct obj *bl = gen_obj_list(), *next = sexp_list(1, loop);
+	for (ptrdiff_t i = 0; i < arrlen(specs); i++) {
+		struct obj **spec = specs[i]->pval;
+		sexp_append_obj_inplace(bl, sexp_list(2, spec[0], spec[1]));
+		sexp_append_obj_inplace(next, arrlen(spec) > 2 ? spec[2] : spec[0]);
 	}
-	return res;
+	struct obj *result = sexp_list(1, gen_obj_symb("begin"));
+	for (ptrdiff_t i = 1; i < arrlen(exit); i++) sexp_append_obj_inplace(result, exit[i]);
+	struct obj *step = sexp_list(1, gen_obj_symb("begin"));
+	for (ptrdiff_t i = 3; i < arrlen(x); i++) sexp_append_obj_inplace(step, x[i]);
+	sexp_append_obj_inplace(step, next);
+	struct obj *body = sexp_list(4, gen_obj_symb("if"), exit[0], result, step);
+	return sexp_list(4, gen_obj_symb("let"), loop, bl, body);
 }
 
 
-struct obj *
-gen_obj_int_strview(struct strview op)
+static struct obj *
+expand(struct obj *ast)
 {
-	struct obj *res = malloc(sizeof(struct obj));
-	res->type = TNUM;
-	res->pval = malloc(sizeof(mpf_t));
-	res->envidx = 0;
-	char opstr[MAX_VALLEN];
-	str_from_strview(opstr, op);
-	mpf_init_set_str(res->pval, opstr, 10);
+	if (ast->type == TSYMB) {
+		for (ptrdiff_t i = arrlen(renames) - 1; i >= 0; i--) {
+			if (strcmp(renames[i].from, ast->pval) != 0) continue;
+			return renames[i].to == renames[i].from ? ast : gen_obj_symb(renames[i].to);
+		}
+		return ast;
+	}
+	if (ast->type != TLIST || arrlen((struct obj **)ast->pval) == 0) return ast;
+	struct obj **x = ast->pval;
+	ptrdiff_t nrenames = arrlen(renames);
+	struct obj *res;
+	if (is_form(x, "quote")) {
+		return ast;
+	} else if (is_form(x, "lambda")) {
+		/// Parameters and internal definitions shadow renamed variables
+		struct name_set *names = NULL;
+		struct obj **parr = x[1]->pval;
+		for (ptrdiff_t i = 0; i < arrlen(parr); i++) add_name(&names, parr[i]->pval);
+		for (ptrdiff_t i = 2; i < arrlen(x); i++) collect_defines(x[i], &names);
+		for (ptrdiff_t i = 0; i < shlen(names); i++) {
+			struct rename r = { .from = names[i].key, .to = names[i].key };
+			arrput(renames, r);
+		}
+		shfree(names);
+		res = sexp_list(3, x[0], x[1], expand_body(x, 2));
+	} else if (is_form(x, "let") && arrlen(x) > 3 && x[1]->type == TSYMB) {
+		res = expand_named_let(x);
+	} else if (is_form(x, "let") || is_form(x, "let*")) {
+		res = expand_let(x, is_form(x, "let*"));
+	} else if (is_form(x, "letrec") || is_form(x, "letrec*")) {
+		res = expand_letrec(x);
+	} else if (is_form(x, "do")) {
+		res = expand(do_to_named_let(x));
+	} else if (is_form(x, "delay")) {
+		struct obj *thunk = sexp_list(3, gen_obj_symb("lambda"), gen_obj_list(), x[1]);
+		res = sexp_list(2, gen_obj_symb("%delay"), expand(thunk));
+	} else if (is_form(x, "cons-stream")) {
+		struct obj *tail = sexp_list(2, gen_obj_symb("delay"), x[2]);
+		res = sexp_list(3, gen_obj_symb("list"), expand(x[1]), expand(tail));
+	} else {
+		res = gen_obj_list();
+		for (ptrdiff_t i = 0; i < arrlen(x); i++) sexp_append_obj_inplace(res, expand(x[i]));
+	}
+	arrsetlen(renames, nrenames);
+	ptrdiff_t li = hmgeti(src_locs, ast);
+	if (li >= 0 && hmgeti(src_locs, res) < 0) hmput(src_locs, res, src_locs[li].value);
 	return res;
 }
 
 
-struct obj *
-gen_obj_symb(char *symb)
+static void
+emit_incl(char ***out)
 {
-	struct obj *res = malloc(sizeof(struct obj));
-	res->type = TSYMB;
-	size_t symb_len = strlen(symb) + 1;
-	res->pval = malloc(symb_len);
-	memcpy(res->pval, symb, symb_len);
-	res->envidx = 0;
-	return res;
+	char **outarr = *out;
+	arrput(outarr,
+		"#include <stdlib.h>\n"
+		"#include \"runtime.h\"\n\n"
+	);
+	*out = outarr;
 }
 
 
-// struct obj *
-// gen_obj_fract(long int nom, long int den)
-// {
-	// struct obj *res = malloc(sizeof(struct obj));
+static void
+emit_main_top(char ***out)
+{
+	char **outarr = *out;
+	if (options.sanitize) {
+		/// Objects are never freed, so leaks are not reported
+		arrput(outarr, "const char *__asan_default_options(void) { return \"detect_leaks=0\"; }\n\n");
+	}
+	arrput(outarr,
+		"int\n"
+		"main(int argc, char *argv[])\n"
+		"{\n"
+		"	int ret = EXIT_FAILURE;\n"
+	);
+	if (options.alloc_stats) arrput(outarr, "	alloc_stats_init();\n");
+	arrput(outarr, "	init_runtime();\n");
+	if (options.profile) arrput(outarr, "	prof_init();\n");
+	if (options.profile || options.alloc_stats) arrput(outarr, "	register_names();\n");
+	*out = outarr;
+}
+
+
+static void
+emit_main_bottom(char ***out)
+{
+	char **outarr = *out;
+	arrput(outarr,
+		"	ret = EXIT_SUCCESS;\n"
+		"	deinit_runtime();\n"
+		"	return ret;\n"
+		"}\n"
+	);
+	*out = outarr;
+}
+
+
+/// Quote and escape len bytes of s as a C string literal
+static char *
+c_literal(const char *s, size_t len)
+{
+	struct port sp = { .f = NULL, .buf = NULL };
+	char oct[8];
+	port_putc(&sp, '"');
+	for (size_t i = 0; i < len; i++) {
+		unsigned char c = s[i];
+		if (c == '"' || c == '\\') {
+			port_putc(&sp, '\\');
+			port_putc(&sp, c);
+		} else if (isprint(c)) {
+			port_putc(&sp, c);
+		} else {
+			snprintf(oct, sizeof(oct), "\\%03o", c);
+			port_puts(&sp, oct);
+		}
+	}
+	port_putc(&sp, '"');
+	port_putc(&sp, '\0');
+	char *ret = strdup(sp.buf);
+	arrfree(sp.buf);
+	return ret;
+}
+
+
+/// Local slot or closure slot of a variable in the scope compiled
+static int
+resolve_var(char *name, ptrdiff_t *idx, bool *boxed)
+{
+	if (!scope) return VGLOBAL;
+	ptrdiff_t i = shgeti(scope->locals, name);
+	if (i >= 0) {
+		*idx = i;
+		*boxed = scope->local_boxed[i];
+		return VLOCAL;
+	}
+	for (ptrdiff_t i = 0; i < arrlen(scope->captured); i++) {
+		if (strcmp(scope->captured[i], name) == 0) {
+			*idx = i;
+			*boxed = scope->captured_boxed[i];
+			return VCAPTURED;
+		}
+	}
+	return VGLOBAL;
+}
+
+
+/// C expression for the value of a variable, or for its box if raw
+static char *
+var_ref(char *name, bool raw)
+{
+	ptrdiff_t idx;
+	bool boxed;
+	switch (resolve_var(name, &idx, &boxed)) {
+	case VLOCAL:
+		return str_fmt(boxed && !raw ? "BOX_REF(loc[%td])" : "loc[%td]", idx);
+	case VCAPTURED:
+		return str_fmt(boxed && !raw ? "BOX_REF(fv[%td])" : "fv[%td]", idx);
+	default:
+		return str_fmt("GLOBAL_REF(gc_%d, \"%s\", %d)", cache_idx++, name, builtin_index(name));
+	}
+}
+
+
+static void
+emit_lambda_decl(char ***out, char *name)
+{
+	/// Lambdas of modules are static, so they don't collide when linked
+	char **outarr = *out;
+	arrput(outarr, str_fmt("%svoid %s(int nargs);\n", options.module ? "static " : "", name));
+	*out = outarr;
+}
+
+
+static void
+emit_lambda_def(char ***out, struct func_def *fdp)
+{
+	/// Generate function definition outside of main() by
+	/// generating code to pop the parms into the local variables
+	struct func_def fd = *fdp;
+	char **outarr = *out;
+	arrput(outarr, str_fmt("%svoid %s(int nargs)\n", options.module ? "static " : "", fd.name));
+	arrput(outarr, "{\n");
+	struct scope *sc = new_scope(&fd, false);
+	if (arrlen(sc->captured) > 0) {
+		arrput(outarr, "	struct obj **fv = closure_vars();\n");
+	}
+	if (shlen(sc->locals) > 0) {
+		arrput(outarr, str_fmt("	struct obj *loc[%td] = {0};\n", shlen(sc->locals)));
+	}
+	ptrdiff_t nparms = arrlen((struct obj **)fd.parms->pval);
+	for (ptrdiff_t i = nparms - 1; i >= 0; i--) {
+		arrput(outarr, str_fmt(sc->local_boxed[i] ? "	loc[%td] = gen_obj_box(pop());\n"
+			: "	loc[%td] = pop();\n", i));
+	}
+	for (ptrdiff_t i = nparms; i < sc->let_base; i++) {
+		if (!sc->local_boxed[i]) continue;
+		arrput(outarr, str_fmt("	loc[%td] = gen_obj_box(NULL);\n", i));
+	}
+	/// Generate code for the function body
+	struct scope *enclosing = scope;
+	scope = sc;
+	char *enclosing_name = cur_src_name;
+	cur_src_name = fd.src_name;
+	*out = outarr;
+	emitted_line = 0;
+	emit_body(out, fd.body, fd.src_name);
+	outarr = *out;
+	cur_src_name = enclosing_name;
+	scope = enclosing;
+	arrput(outarr, line_reset);
+	arrput(outarr, "}\n");
+	*out = outarr;
+}
+
+
+static void
+emit_register_names(char ***out)
+{
+	/// Register source names of all lambdas for the profile and allocation reports
+	char **outarr = *out;
+	arrput(outarr, options.module ? "static void\n" : "void\n");
+	arrput(outarr,
+		"register_names(void)\n"
+		"{\n"
+	);
+	for (size_t i = 0; i < arrlenu(func_defs); i++) {
+		char *lit = c_literal(func_defs[i].src_name, strlen(func_defs[i].src_name));
+		size_t so_len = strlen(lit) + strlen(func_defs[i].name) + 32;
+		char *so = malloc(so_len);
+		snprintf(so, so_len, "	name_fn(%s, %s);\n", func_defs[i].name, lit);
+		free(lit);
+		arrput(outarr, so);
+	}
+	arrput(outarr, "}\n");
+	*out = outarr;
+}
+
+
+/// Name of the initialization function of the module in file_name
+static char *
+module_init_name(const char *file_name)
+{
+	/// The path of the module, as imported relative to the importing
+	/// unit, keeps modules of the same name in different directories
+	/// apart. Other characters than letters and digits are escaped as _
+	/// and their hex code, _ as __, so different paths give different names.
+	char *path = chop_file_ext((char *)file_name);
+	char *name = malloc(strlen(path) * 3 + 16);
+	char *n = name + sprintf(name, "scm_init_");
+	for (unsigned char *c = (unsigned char *)path; *c; c++) {
+		if (isalnum(*c)) *n++ = *c;
+		else if (*c == '_') n += sprintf(n, "__");
+		else n += sprintf(n, "_%02x", *c);
+	}
+	*n = '\0';
+	return name;
+}
+
+
+/// Whether file is missing or older than src
+static bool
+out_of_date(const char *file, const char *src)
+{
+	struct stat fst, sst;
+	if (stat(src, &sst) != 0) panic("could not find module '%s'\n", src);
+	if (stat(file, &fst) != 0) return true;
+	if (fst.st_mtim.tv_sec != sst.st_mtim.tv_sec) return fst.st_mtim.tv_sec < sst.st_mtim.tv_sec;
+	return fst.st_mtim.tv_nsec < sst.st_mtim.tv_nsec;
+}
+
+
+/// Word of a shell command that is the string s
+static char *
+shell_quote(const char *s)
+{
+	struct port q = { .f = NULL, .buf = NULL };
+	port_putc(&q, '\'');
+	for (; *s; s++) {
+		if (*s == '\'') port_puts(&q, "'\\''");
+		else port_putc(&q, *s);
+	}
+	port_putc(&q, '\'');
+	port_putc(&q, '\0');
+	char *word = strdup(q.buf);
+	arrfree(q.buf);
+	return word;
+}
+
+
+/// Appends the word s and a space to the shell command in p
+static void
+put_word(struct port *p, const char *s)
+{
+	char *word = shell_quote(s);
+	port_puts(p, word);
+	port_putc(p, ' ');
+	free(word);
+}
+
+
+/// Options of the compiler that change the code of a module
+static char *
+module_flags(void)
+{
+	return str_fmt("%s%s%s", options.profile ? " --profile" : "",
+		options.alloc_stats ? " --alloc-stats" : "", options.sanitize ? " --sanitize" : "");
+}
+
+
+/// Whether the interface intf records that its module was compiled with flags
+static bool
+same_flags(const char *intf, const char *flags)
+{
+	FILE *f = fopen(intf, "r");
+	if (!f) return false;
+	char *line = NULL;
+	size_t cap = 0;
+	bool same = false;
+	while (getline(&line, &cap, f) != -1) {
+		line[strcspn(line, "\n")] = '\0';
+		if (strncmp(line, "flags", 5) == 0) {
+			same = strcmp(line + 5, flags) == 0;
+			break;
+		}
+	}
+	free(line);
+	fclose(f);
+	return same;
+}
+
+
+/// Compile the module in src unless it is up to date, require the modules
+/// it imports and link them all. Returns the name of the module's
+/// initialization function, as its interface records it.
+static char *
+require_module(char *src)
+{
+	char *base = chop_file_ext(src);
+	char *obj = add_suffix(base, ".o");
+	for (ptrdiff_t i = 0; i < arrlen(link_objs); i++) {
+		if (strcmp(link_objs[i], obj) == 0) return link_inits[i];
+	}
+	ptrdiff_t idx = arrlen(link_objs);
+	arrput(link_objs, obj);
+	arrput(link_inits, module_init_name(src));
+	char *intf = add_suffix(base, ".scmi");
+	char *flags = module_flags();
+	if (out_of_date(obj, src) || out_of_date(intf, src) || !same_flags(intf, flags)) {
+		/// The modules being compiled by the compilers that started this
+		/// one are passed down in SCHEMEL_IMPORTING, so a cycle of imports
+		/// stops instead of starting compilers without end
+		char *path = realpath(src, NULL);
+		if (!path) path = src;
+		const char *chain = getenv("SCHEMEL_IMPORTING");
+		size_t plen = strlen(path);
+		for (const char *c = chain; c && *c; c += strcspn(c, ":"), c += *c == ':') {
+			if (strncmp(c, path, plen) == 0 && (c[plen] == ':' || c[plen] == '\0')) {
+				panic("cyclic import of module '%s'\n", src);
+			}
+		}
+		char *new_chain = chain && *chain ? str_fmt("%s:%s", chain, path) : strdup(path);
+		setenv("SCHEMEL_IMPORTING", new_chain, 1);
+		char *self = shell_quote(options.self), *file = shell_quote(src);
+		char *cmd = str_fmt("%s --module%s %s", self, flags, file);
+		int status = system(cmd);
+		if (chain) setenv("SCHEMEL_IMPORTING", chain, 1);
+		else unsetenv("SCHEMEL_IMPORTING");
+		if (status != 0) panic("could not compile module '%s'\n", src);
+		free(cmd);
+		free(self);
+		free(file);
+		free(new_chain);
+	}
+	free(flags);
+	FILE *f = fopen(intf, "r");
+	if (!f) panic("could not read the interface of module '%s'\n", src);
+	char *line = NULL;
+	size_t cap = 0;
+	while (getline(&line, &cap, f) != -1) {
+		line[strcspn(line, "\n")] = '\0';
+		if (strncmp(line, "import ", 7) == 0) require_module(strdup(line + 7));
+		if (strncmp(line, "export ", 7) == 0) add_name(&assigned_globals, strdup(line + 7));
+		if (strncmp(line, "init ", 5) == 0) link_inits[idx] = strdup(line + 5);
+	}
+	free(line);
+	fclose(f);
+	return link_inits[idx];
+}
+
+
+/// Source file of the module (import spec) names
+static char *
+module_src(struct obj *spec)
+{
+	/// (import name) imports the module name.scm, (import "file") the module file
+	char *name = NULL;
+	if (spec->type == TSYMB) {
+		name = add_suffix(spec->pval, ".scm");
+	} else if (spec->type == TSTRING) {
+		struct string *str = spec->pval;
+		name = strndup(str->buf->data + str->off, str->len);
+	} else {
+		panic("import: expected a module name\n");
+	}
+	return name[0] == FILE_SEP ? name : add_suffix(unit_dir, name);
+}
+
+
+static char *
+import_module(struct obj *spec)
+{
+	char *src = module_src(spec);
+	char *init = require_module(src);
+	add_name(&unit_imports, src);
+	arrput(func_decls, str_fmt("void %s(void);\n", init));
+	return init;
+}
+
+
+static void load_imports(struct obj *ast);
+
+
+/// Reads, parses and expands the module in src to run it in process, and
+/// the modules it imports, once. Returns src, it names the module's code.
+static char *
+load_module(char *src)
+{
+	if (shgeti(run_modules, src) >= 0) return src;
+	char *text = read_file(src);
+	struct obj *ast = sexp_list(1, gen_obj_symb("begin"));
+	parse_source(src, text);
+	parse(&ast, &text);
+	ast = expand(ast);
+	shput(run_modules, src, ast);
+	collect_assigned(ast, &assigned_globals);
+	char *importer_dir = unit_dir;
+	char *slash = strrchr(src, FILE_SEP);
+	unit_dir = slash ? strndup(src, slash - src + 1) : "";
+	load_imports(ast);
+	unit_dir = importer_dir;
+	return src;
+}
+
+
+static void
+load_imports(struct obj *ast)
+{
+	if (ast->type != TLIST || arrlen((struct obj **)ast->pval) == 0) return;
+	struct obj **x = ast->pval;
+	if (is_form(x, "quote")) return;
+	if (is_form(x, "import")) {
+		load_module(module_src(x[1]));
+		return;
+	}
+	for (ptrdiff_t i = first_subexpr(x); i < arrlen(x); i++) load_imports(x[i]);
+}
+
+
+static void
+emit_module_top(char ***out, char *file_name)
+{
+	/// Modules have no main(), their initialization function runs the
+	/// top level once
+	char **outarr = *out;
+	char *init = module_init_name(file_name);
+	char *so = str_fmt(
+		"void\n"
+		"%s(void)\n"
+		"{\n"
+		"	static bool done = false;\n"
+		"	if (done) return;\n"
+		"	done = true;\n", init);
+	arrput(outarr, so);
+	if (options.profile || options.alloc_stats) arrput(outarr, "	register_names();\n");
+	*out = outarr;
+}
+
+
+static void
+emit_module_bottom(char ***out)
+{
+	char **outarr = *out;
+	arrput(outarr,
+		"	pop();\n"
+		"}\n"
+	);
+	*out = outarr;
+}
+
+
+/// Lowering of the AST to the IR
+static struct ir *
+new_ir(int kind)
+{
+	struct ir *ir = calloc(1, sizeof(struct ir));
+	ir->kind = kind;
+	ir->line = cur_line;
+	return ir;
+}
+
+
+static struct ir *
+ir_temp(int temp)
+{
+	struct ir *ir = new_ir(IR_TEMP);
+	ir->temp = temp;
+	return ir;
+}
+
+
+static struct ir *
+ir_let(struct ir *rhs)
+{
+	/// Binds a new temporary to rhs, the body is filled in later
+	struct ir *ir = new_ir(IR_LET);
+	ir->temp = ntemps++;
+	ir->rhs = rhs;
+	return ir;
+}
+
+
+static bool
+ir_atomic(struct ir *ir)
+{
+	return ir->kind == IR_LIT || ir->kind == IR_VAR || ir->kind == IR_TEMP || ir->kind == IR_VOID;
+}
+
+
+static bool
+is_lambda(struct obj *obj)
+{
+	if (obj->type != TLIST || arrlenu((struct obj **)obj->pval) == 0) return false;
+	struct obj *fo = ((struct obj **)obj->pval)[0];
+	return fo->type == TSYMB && strcmp(fo->pval, "lambda") == 0;
+}
+
+
+static struct ir *
+lower_var(char *name, bool raw)
+{
+	struct ir *ir = new_ir(IR_VAR);
+	ir->name = name;
+	ir->raw = raw;
+	ir->var_kind = resolve_var(name, &ir->idx, &ir->boxed);
+	/// Parameters that are never assigned, captured variables that aren't
+	/// boxed and boxes keep their value
+	if (ir->var_kind == VLOCAL) {
+		ir->stable = raw || (!ir->boxed && !scope->local_assigned[ir->idx]);
+	} else if (ir->var_kind == VCAPTURED) {
+		ir->stable = raw || !ir->boxed;
+	}
+	return ir;
+}
+
+
+static struct ir *lower(struct obj *ast);
+
+
+/// Loop being lowered that name refers to, if any
+static struct ir *
+loop_named(char *name)
+{
+	for (ptrdiff_t i = arrlen(loops) - 1; i >= 0; i--) {
+		if (strcmp(loops[i]->name, name) == 0) return loops[i];
+	}
+	return NULL;
+}
+
+
+/// Lowers ast to an operand. Values that aren't atoms, and variables that
+/// may change before the operand is used, are bound to temporaries by
+/// lets appended to binds.
+static struct ir *
+lower_operand(struct obj *ast, struct ir ***binds)
+{
+	struct ir *ir = lower(ast);
+	if (ir_atomic(ir) && (ir->kind != IR_VAR || ir->stable)) return ir;
+	struct ir *let = ir_let(ir);
+	arrput(*binds, let);
+	return ir_temp(let->temp);
+}
+
+
+/// Wraps body in the lets of binds, the first outermost
+static struct ir *
+wrap_lets(struct ir **binds, struct ir *body)
+{
+	for (ptrdiff_t i = arrlen(binds) - 1; i >= 0; i--) {
+		binds[i]->body = body;
+		body = binds[i];
+	}
+	arrfree(binds);
+	return body;
+}
+
+
+static struct ir *
+lower_lambda(struct obj *ast)
+{
+	struct obj **x = ast->pval;
+	char *lambda_name = str_fmt("lambda_%d", label_idx);
+	/// Name the lambda after its binding, or else after the outermost
+	/// enclosing lambda, so names don't grow with the nesting depth
+	char *src_name = binding_name;
+	bool bound = binding_name != NULL;
+	binding_name = NULL;
+	if (!src_name && cur_src_name) {
+		src_name = str_fmt("%.*s/%s", (int)strcspn(cur_src_name, "/"), cur_src_name, lambda_name);
+	} else if (!src_name) {
+		src_name = lambda_name;
+	}
+	/// The C function is named after it too, scm_fact_3 for the third
+	/// lambda, bound to fact, and scm_fact_lambda_4 for one in it
+	char *c_name = bound ? str_fmt("scm_%s_%d", src_name, label_idx) : str_fmt("scm_%s", src_name);
+	for (char *c = c_name; *c; c++) *c = isalnum(*c) ? *c : '_';
+	label_idx++;
+	struct func_def fd = {
+		.parms = x[1],
+		.body = x[2],
+		.name = c_name,
+		.src_name = src_name
+	};
+	/// The closure captures the values, or boxes, of its free variables
+	/// that aren't globals
+	struct ir *ir = new_ir(IR_LAMBDA);
+	char **fv = lambda_free_vars(ast);
+	for (ptrdiff_t i = 0; i < arrlen(fv); i++) {
+		struct ir *var = lower_var(fv[i], true);
+		if (var->var_kind == VGLOBAL) continue;
+		arrput(fd.captured, fv[i]);
+		arrput(fd.captured_boxed, var->boxed);
+		arrput(ir->args, var);
+	}
+	ir->idx = arrlen(func_defs);
+	arrput(func_defs, fd);
+	return ir;
+}
+
+
+static struct ir *
+lower(struct obj *ast)
+{
+	if (ast->type == TSYMB) return lower_var(ast->pval, false);  /// Variable reference
+	if (ast->type != TLIST) {  /// Number or string literal
+		struct ir *ir = new_ir(IR_LIT);
+		ir->obj = ast;
+		return ir;
+	}
+	struct obj **x = ast->pval;
+	struct ir **binds = NULL;
+	struct ir *ir = NULL;
+	char *symb = x[0]->type == TSYMB ? x[0]->pval : "";
+	int enclosing_line = cur_line;
+	ptrdiff_t li = hmgeti(src_locs, ast);
+	if (li >= 0) cur_line = src_locs[li].value.line;
+	if (strcmp(symb, "quote") == 0) {
+		ir = new_ir(IR_QUOTE);
+		ir->obj = x[1];
+	} else if (strcmp(symb, "if") == 0) {
+		ir = new_ir(IR_IF);
+		ir->test = lower_operand(x[1], &binds);
+		ir->conseq = lower(x[2]);
+		ir->alter = arrlen(x) > 3 ? lower(x[3]) : new_ir(IR_VOID);
+	} else if (strcmp(symb, "define") == 0 || strcmp(symb, "set!") == 0) {
+		if (is_lambda(x[2])) binding_name = x[1]->pval;
+		struct ir *value = lower_operand(x[2], &binds);
+		ir = lower_var(x[1]->pval, false);
+		ir->kind = IR_ASSIGN;
+		ir->value = value;
+	} else if (strcmp(symb, "begin") == 0) {
+		/// The values of all but the last expression are bound to unused temporaries
+		if (arrlen(x) == 1) {
+			ir = new_ir(IR_VOID);
+		} else {
+			for (ptrdiff_t i = 1; i < arrlen(x) - 1; i++) arrput(binds, ir_let(lower(x[i])));
+			ir = lower(x[arrlen(x) - 1]);
+		}
+	} else if (strcmp(symb, "let") == 0) {
+		/// The inits are evaluated, then the variables bound
+		struct obj **b = x[1]->pval;
+		struct ir **values = NULL;
+		for (ptrdiff_t i = 0; i < arrlen(b); i++) {
+			struct obj **pair = b[i]->pval;
+			if (is_lambda(pair[1])) binding_name = src_var_name(pair[0]->pval);
+			arrput(values, lower_operand(pair[1], &binds));
+		}
+		for (ptrdiff_t i = 0; i < arrlen(b); i++) {
+			struct ir *bind = lower_var(((struct obj **)b[i]->pval)[0]->pval, true);
+			bind->kind = IR_BIND;
+			bind->value = values[i];
+			arrput(binds, ir_let(bind));
+		}
+		arrfree(values);
+		ir = lower(x[2]);
+	} else if (strcmp(symb, "letrec") == 0) {
+		/// The variables are bound, then the inits evaluated and assigned
+		struct obj **b = x[1]->pval;
+		for (ptrdiff_t i = 0; i < arrlen(b); i++) {
+			struct ir *bind = lower_var(((struct obj **)b[i]->pval)[0]->pval, true);
+			bind->kind = IR_BIND;
+			bind->value = new_ir(IR_VOID);
+			arrput(binds, ir_let(bind));
+		}
+		for (ptrdiff_t i = 0; i < arrlen(b); i++) {
+			struct obj **pair = b[i]->pval;
+			if (is_lambda(pair[1])) binding_name = src_var_name(pair[0]->pval);
+			struct ir *value = lower_operand(pair[1], &binds);
+			struct ir *assign = lower_var(pair[0]->pval, false);
+			assign->kind = IR_ASSIGN;
+			assign->value = value;
+			arrput(binds, ir_let(assign));
+		}
+		ir = lower(x[2]);
+	} else if (strcmp(symb, "%loop") == 0) {
+		/// Calls of the loop in its body are jumps back to it
+		struct obj **b = x[2]->pval;
+		ir = new_ir(IR_LOOP);
+		ir->name = x[1]->pval;
+		ir->idx = loop_idx++;
+		for (ptrdiff_t i = 0; i < arrlen(b); i++) {
+			struct obj **pair = b[i]->pval;
+			arrput(ir->args, lower_operand(pair[1], &binds));
+			arrput(ir->vars, lower_var(pair[0]->pval, true));
+		}
+		arrput(loops, ir);
+		ir->body = lower(x[3]);
+		arrpop(loops);
+	} else if (strcmp(symb, "import") == 0) {
+		ir = new_ir(IR_IMPORT);
+		ir->name = options.run ? load_module(module_src(x[1])) : import_module(x[1]);
+	} else if (strcmp(symb, "display") == 0) {
+		ir = new_ir(IR_DISPLAY);
+		ir->value = lower_operand(x[1], &binds);
+	} else if (strcmp(symb, "future") == 0) {
+		/// (future e) is (make-future (lambda () e))
+		struct obj *thunk = sexp_list(3, gen_obj_symb("lambda"), gen_obj_list(), x[1]);
+		ir = lower(sexp_list(2, gen_obj_symb("make-future"), thunk));
+	} else if (strcmp(symb, "lambda") == 0) {
+		ir = lower_lambda(ast);
+	} else if (loop_named(symb)) {
+		ir = new_ir(IR_JUMP);
+		ir->loop = loop_named(symb);
+		if (arrlen(x) - 1 != arrlen(ir->loop->vars)) {
+			struct src_loc loc = li >= 0 ? src_locs[li].value : (struct src_loc){ .file = "?" };
+			panic("%s:%d:%d: %s: expected %td arguments\n", loc.file, loc.line, loc.col,
+				src_var_name(symb), arrlen(ir->loop->vars));
+		}
+		for (ptrdiff_t i = 1; i < arrlen(x); i++) arrput(ir->args, lower_operand(x[i], &binds));
+	} else {  /// Call (proc arg ...), the procedure is evaluated after the arguments
+		ir = new_ir(IR_CALL);
+		for (ptrdiff_t i = 1; i < arrlen(x); i++) arrput(ir->args, lower_operand(x[i], &binds));
+		ir->fn = lower_operand(x[0], &binds);
+	}
+	ir = wrap_lets(binds, ir);
+	cur_line = enclosing_line;
+	return ir;
+}
+
+
+/// Optimization of the IR
+static bool
+global_fixed(char *name)
+{
+	/// Builtins that neither the program nor its modules define or assign
+	/// keep their value. A module can't tell, any program may import it.
+	return !options.module && builtin_index(name) >= 0 && !has_name(assigned_globals, name);
+}
+
+
+/// Whether the value of an atom can't change while it is in scope
+static bool
+atom_stable(struct ir *a)
+{
+	if (a->kind != IR_VAR) return true;
+	return a->var_kind == VGLOBAL ? global_fixed(a->name) : a->stable;
+}
+
+
+/// Whether e is a call of a builtin without effects
+static bool
+pure_call(struct ir *e)
+{
+	return e->kind == IR_CALL && e->fn->kind == IR_VAR && e->fn->var_kind == VGLOBAL
+		&& global_fixed(e->fn->name) && builtin_pure(builtin_index(e->fn->name));
+}
+
+
+/// Whether evaluating ir has no effects, other than failing
+static bool
+ir_pure(struct ir *ir)
+{
+	for (; ir->kind == IR_LET; ir = ir->body) {
+		if (!ir_pure(ir->rhs)) return false;
+	}
+	switch (ir->kind) {
+	case IR_CALL:
+		return pure_call(ir);
+	case IR_IF:
+		return ir_pure(ir->conseq) && ir_pure(ir->alter);
+	case IR_ASSIGN:
+	case IR_DISPLAY:
+	case IR_IMPORT:
+	case IR_BIND:
+	case IR_LOOP:
+	case IR_JUMP:
+		return false;
+	default:
+		return true;
+	}
+}
+
+
+/// Whether evaluating ir may assign variables
+static bool
+may_assign(struct ir *ir)
+{
+	for (; ir->kind == IR_LET; ir = ir->body) {
+		if (may_assign(ir->rhs)) return true;
+	}
+	switch (ir->kind) {
+	case IR_CALL:
+		return !pure_call(ir);
+	case IR_IF:
+		return may_assign(ir->conseq) || may_assign(ir->alter);
+	case IR_ASSIGN:
+	case IR_IMPORT:
+	case IR_LOOP:
+	case IR_JUMP:
+		return true;
+	default:
+		return false;
+	}
+}
+
+
+/// Whether evaluating ir is pure and yields the same value anywhere in
+/// the scope of the temporaries it uses
+static bool
+ir_movable(struct ir *ir)
+{
+	switch (ir->kind) {
+	case IR_CALL:
+		if (!pure_call(ir)) return false;
+		for (ptrdiff_t i = 0; i < arrlen(ir->args); i++) {
+			if (!atom_stable(ir->args[i])) return false;
+		}
+		return true;
+	case IR_QUOTE:
+	case IR_LAMBDA:
+		return true;
+	default:
+		return ir_atomic(ir) && atom_stable(ir);
+	}
+}
+
+
+/// Adds delta to the use counts of the temporaries used in ir
+static void
+count_uses(struct ir *ir, int delta)
+{
+	for (; ir->kind == IR_LET; ir = ir->body) count_uses(ir->rhs, delta);
+	switch (ir->kind) {
+	case IR_TEMP:
+		temp_uses[ir->temp] += delta;
+		break;
+	case IR_CALL:
+	case IR_LOOP:
+	case IR_JUMP:
+		if (ir->fn) count_uses(ir->fn, delta);
+		for (ptrdiff_t i = 0; i < arrlen(ir->args); i++) count_uses(ir->args[i], delta);
+		if (ir->body) count_uses(ir->body, delta);
+		break;
+	case IR_IF:
+		count_uses(ir->test, delta);
+		count_uses(ir->conseq, delta);
+		count_uses(ir->alter, delta);
+		break;
+	case IR_ASSIGN:
+	case IR_DISPLAY:
+	case IR_BIND:
+		count_uses(ir->value, delta);
+		break;
+	}
+}
+
+
+static void
+recount_uses(struct ir *ir)
+{
+	arrsetlen(temp_uses, ntemps);
+	memset(temp_uses, 0, sizeof(int) * ntemps);
+	count_uses(ir, 1);
+}
+
+
+/// Number of uses of temp in ir
+static int
+uses_of(struct ir *ir, int temp)
+{
+	int n = 0;
+	for (; ir->kind == IR_LET; ir = ir->body) n += uses_of(ir->rhs, temp);
+	switch (ir->kind) {
+	case IR_TEMP:
+		return n + (ir->temp == temp);
+	case IR_CALL:
+	case IR_LOOP:
+	case IR_JUMP:
+		if (ir->fn) n += uses_of(ir->fn, temp);
+		for (ptrdiff_t i = 0; i < arrlen(ir->args); i++) n += uses_of(ir->args[i], temp);
+		if (ir->body) n += uses_of(ir->body, temp);
+		return n;
+	case IR_IF:
+		return n + uses_of(ir->test, temp) + uses_of(ir->conseq, temp) + uses_of(ir->alter, temp);
+	case IR_ASSIGN:
+	case IR_DISPLAY:
+	case IR_BIND:
+		return n + uses_of(ir->value, temp);
+	default:
+		return n;
+	}
+}
+
+
+/// Let-floating outwards: the lets in the rhs of a let are floated out of
+/// it, so let chains are flat and every rhs is a single expression. Sets
+/// last to the last let of the chain returned, so deeply nested rhs are
+/// floated in linear time.
+static struct ir *
+float_out(struct ir *ir, struct ir **last)
+{
+	struct ir **slot = &ir, *rhs_last;
+	*last = NULL;
+	for (;;) {
+		struct ir *e = *slot;
+		if (e->kind == IR_IF) {
+			e->conseq = float_out(e->conseq, &rhs_last);
+			e->alter = float_out(e->alter, &rhs_last);
+		}
+		if (e->kind == IR_LOOP) e->body = float_out(e->body, &rhs_last);
+		if (e->kind != IR_LET) return ir;
+		e->rhs = float_out(e->rhs, &rhs_last);
+		if (e->rhs->kind == IR_LET) {
+			*slot = e->rhs;
+			e->rhs = rhs_last->body;
+			rhs_last->body = e;
+		}
+		*last = e;
+		slot = &e->body;
+	}
+}
+
+
+static bool
+same_datum(struct obj *a, struct obj *b)
+{
+	if (a->type != b->type) return false;
+	switch (a->type) {
+	case TNUM:
+		return mpf_cmp(a->pval, b->pval) == 0;
+	case TSYMB:
+		return strcmp(a->pval, b->pval) == 0;
+	case TSTRING: {
+		struct string *sa = a->pval, *sb = b->pval;
+		return sa->len == sb->len
+			&& memcmp(sa->buf->data + sa->off, sb->buf->data + sb->off, sa->len) == 0;
+	}
+	default:
+		return a == b;
+	}
+}
+
+
+static bool
+ir_equal(struct ir *a, struct ir *b)
+{
+	if (a->kind != b->kind) return false;
+	switch (a->kind) {
+	case IR_LIT:
+	case IR_QUOTE:
+		return same_datum(a->obj, b->obj);
+	case IR_VAR:
+		if (a->var_kind != b->var_kind || a->raw != b->raw) return false;
+		return a->var_kind == VGLOBAL ? strcmp(a->name, b->name) == 0 : a->idx == b->idx;
+	case IR_TEMP:
+		return a->temp == b->temp;
+	case IR_VOID:
+		return true;
+	case IR_CALL:
+		if (!ir_equal(a->fn, b->fn) || arrlen(a->args) != arrlen(b->args)) return false;
+		for (ptrdiff_t i = 0; i < arrlen(a->args); i++) {
+			if (!ir_equal(a->args[i], b->args[i])) return false;
+		}
+		return true;
+	default:
+		return false;
+	}
+}
+
+
+static size_t hash_bytes(const void *p, size_t len);
+static size_t hash_obj(struct obj *obj);
+
+
+/// Hash of e, equal for expressions ir_equal considers equal
+static size_t
+ir_hash(struct ir *e)
+{
+	size_t h = e->kind;
+	switch (e->kind) {
+	case IR_LIT:
+	case IR_QUOTE:
+		return h * 31 + hash_obj(e->obj);
+	case IR_VAR:
+		h = (h * 31 + e->var_kind) * 31 + e->raw;
+		return h * 31 + (e->var_kind == VGLOBAL ? hash_bytes(e->name, strlen(e->name)) : (size_t)e->idx);
+	case IR_TEMP:
+		return h * 31 + e->temp;
+	case IR_CALL:
+		h = h * 31 + ir_hash(e->fn);
+		for (ptrdiff_t i = 0; i < arrlen(e->args); i++) h = h * 31 + ir_hash(e->args[i]);
+		return h;
+	default:
+		return h;
+	}
+}
+
+
+/// Common subexpression elimination: a let whose rhs is equal to the rhs
+/// of an enclosing let, and is pure of stable operands, is bound to the
+/// enclosing let's temporary. Lists are compared by identity, so only
+/// quoted atoms and calls of builtins are candidates. The available lets
+/// with equal hashes are chained, so lookups don't scan them all.
+static void
+cse(struct ir *ir)
+{
+	ptrdiff_t navail = arrlen(cse_avail);
+	for (;; ir = ir->body) {
+		struct ir *e = ir->kind == IR_LET ? ir->rhs : ir;
+		if (e->kind == IR_IF) {
+			cse(e->conseq);
+			cse(e->alter);
+		}
+		if (e->kind == IR_LOOP) cse(e->body);
+		if (ir->kind != IR_LET) break;
+		bool candidate = e->kind == IR_QUOTE ? e->obj->type != TLIST
+			: e->kind == IR_CALL && ir_movable(e);
+		if (!candidate) continue;
+		size_t hash = ir_hash(e);
+		ptrdiff_t latest = hmgeti(cse_latest, hash) >= 0 ? hmget(cse_latest, hash) : -1;
+		ptrdiff_t i = latest;
+		while (i >= 0 && !ir_equal(cse_avail[i].let->rhs, e)) i = cse_avail[i].prev;
+		if (i >= 0) {
+			ir->rhs = ir_temp(cse_avail[i].let->temp);
+		} else {
+			struct cse_entry entry = { .let = ir, .hash = hash, .prev = latest };
+			arrput(cse_avail, entry);
+			hmput(cse_latest, hash, arrlen(cse_avail) - 1);
+		}
+	}
+	for (ptrdiff_t i = arrlen(cse_avail) - 1; i >= navail; i--) {
+		hmput(cse_latest, cse_avail[i].hash, cse_avail[i].prev);
+	}
+	arrsetlen(cse_avail, navail);
+}
+
+
+static int
+replace_temp(struct ir **slot, int temp, struct ir *var)
+{
+	if ((*slot)->kind != IR_TEMP || (*slot)->temp != temp) return 0;
+	*slot = var;
+	return 1;
+}
+
+
+/// Replaces temp by var in the operands of e, read before its effects
+static int
+replace_operands(struct ir **e, int temp, struct ir *var)
+{
+	int n = replace_temp(e, temp, var);
+	switch ((*e)->kind) {
+	case IR_CALL:
+		n += replace_temp(&(*e)->fn, temp, var);
+		/* fallthrough */
+	case IR_LOOP:
+	case IR_JUMP:
+		for (ptrdiff_t i = 0; i < arrlen((*e)->args); i++) n += replace_temp(&(*e)->args[i], temp, var);
+		break;
+	case IR_IF:
+		n += replace_temp(&(*e)->test, temp, var);
+		break;
+	case IR_ASSIGN:
+	case IR_DISPLAY:
+	case IR_BIND:
+		n += replace_temp(&(*e)->value, temp, var);
+		break;
+	}
+	return n;
+}
+
+
+/// Replaces the uses of temp by the variable var in the let chain in slot,
+/// up to the first expression that may assign it, returns their number
+static int
+subst_var(struct ir **slot, int temp, struct ir *var)
+{
+	int n = 0;
+	for (;;) {
+		struct ir **e = (*slot)->kind == IR_LET ? &(*slot)->rhs : slot;
+		n += replace_operands(e, temp, var);
+		if ((*slot)->kind != IR_LET || may_assign(*e)) return n;
+		slot = &(*slot)->body;
+	}
+}
+
+
+static struct ir *copy_prop(struct ir *ir);
+
+
+static struct ir *
+prop_operands(struct ir *e)
+{
+	switch (e->kind) {
+	case IR_TEMP:
+		return temp_subst[e->temp] ? temp_subst[e->temp] : e;
+	case IR_CALL:
+	case IR_LAMBDA:
+	case IR_LOOP:
+	case IR_JUMP:
+		if (e->fn) e->fn = prop_operands(e->fn);
+		for (ptrdiff_t i = 0; i < arrlen(e->args); i++) e->args[i] = prop_operands(e->args[i]);
+		if (e->body) e->body = copy_prop(e->body);
+		break;
+	case IR_IF:
+		e->test = prop_operands(e->test);
+		e->conseq = copy_prop(e->conseq);
+		e->alter = copy_prop(e->alter);
+		break;
+	case IR_ASSIGN:
+	case IR_DISPLAY:
+	case IR_BIND:
+		e->value = prop_operands(e->value);
+		break;
+	}
+	return e;
+}
+
+
+/// Copy propagation: a let binding an atom is removed and its temporary
+/// replaced by the atom. A variable that may change is only propagated up
+/// to the first expression that may assign it, and the let is kept for
+/// the remaining uses. A literal is only propagated to a single use, each
+/// evaluation allocates.
+static struct ir *
+copy_prop(struct ir *ir)
+{
+	struct ir **slot = &ir;
+	for (;;) {
+		struct ir *e = *slot;
+		if (e->kind != IR_LET) {
+			*slot = prop_operands(e);
+			return ir;
+		}
+		e->rhs = prop_operands(e->rhs);
+		struct ir *rhs = e->rhs;
+		if (ir_atomic(rhs) && atom_stable(rhs) && (rhs->kind != IR_LIT || temp_uses[e->temp] <= 1)) {
+			temp_subst[e->temp] = rhs;
+			*slot = e->body;
+			continue;
+		}
+		if (rhs->kind == IR_VAR) {
+			temp_uses[e->temp] -= subst_var(&e->body, e->temp, rhs);
+			if (temp_uses[e->temp] == 0) {
+				*slot = e->body;
+				continue;
+			}
+		}
+		slot = &e->body;
+	}
+}
+
+
+/// Dead binding elimination: a let whose temporary is unused is removed if
+/// its rhs is pure, else the rhs is only evaluated for its effects
+static struct ir *
+dce(struct ir *ir)
+{
+	struct ir **chain = NULL;
+	for (; ir->kind == IR_LET; ir = ir->body) arrput(chain, ir);
+	if (ir->kind == IR_IF) {
+		ir->conseq = dce(ir->conseq);
+		ir->alter = dce(ir->alter);
+	}
+	if (ir->kind == IR_LOOP) ir->body = dce(ir->body);
+	for (ptrdiff_t i = arrlen(chain) - 1; i >= 0; i--) {
+		struct ir *let = chain[i];
+		if (let->rhs->kind == IR_IF) {
+			let->rhs->conseq = dce(let->rhs->conseq);
+			let->rhs->alter = dce(let->rhs->alter);
+		}
+		if (let->rhs->kind == IR_LOOP) let->rhs->body = dce(let->rhs->body);
+		if (temp_uses[let->temp] == 0 && ir_pure(let->rhs)) {
+			count_uses(let->rhs, -1);
+			continue;
+		}
+		let->body = ir;
+		ir = let;
+	}
+	arrfree(chain);
+	return ir;
+}
+
+
+/// The branch of the if following let in its chain that has all uses of
+/// its temporary, if any
+static struct ir **
+branch_using(struct ir *let)
+{
+	int temp = let->temp;
+	if (temp_uses[temp] == 0) return NULL;
+	for (struct ir *ir = let->body; ; ir = ir->body) {
+		struct ir *e = ir->kind == IR_LET ? ir->rhs : ir;
+		if (uses_of(e, temp) > 0) {
+			if (e->kind != IR_IF || uses_of(e->test, temp) > 0) return NULL;
+			if (uses_of(e->conseq, temp) == temp_uses[temp]) return &e->conseq;
+			if (uses_of(e->alter, temp) == temp_uses[temp]) return &e->alter;
+			return NULL;
+		}
+		if (ir->kind != IR_LET) return NULL;
+	}
+}
+
+
+/// Let-floating inwards: a let whose rhs is movable and whose temporary is
+/// only used in one branch of a following if is moved into that branch,
+/// so the other branch doesn't evaluate it
+static struct ir *
+float_in(struct ir *ir)
+{
+	struct ir **slot = &ir;
+	while ((*slot)->kind == IR_LET) {
+		struct ir *let = *slot;
+		struct ir **branch = ir_movable(let->rhs) ? branch_using(let) : NULL;
+		if (branch) {
+			*slot = let->body;
+			let->body = *branch;
+			*branch = let;
+		} else {
+			slot = &let->body;
+		}
+	}
+	for (struct ir *e = ir; ; e = e->body) {
+		struct ir *x = e->kind == IR_LET ? e->rhs : e;
+		if (x->kind == IR_IF) {
+			x->conseq = float_in(x->conseq);
+			x->alter = float_in(x->alter);
+		}
+		if (x->kind == IR_LOOP) x->body = float_in(x->body);
+		if (e->kind != IR_LET) break;
+	}
+	return ir;
+}
+
+
+static struct ir *
+optimize(struct ir *ir)
+{
+	/// Copy propagation exposes the builtins called to common subexpression
+	/// elimination, and propagates the temporaries it reuses
+	struct ir *last;
+	ir = float_out(ir, &last);
+	arrsetlen(temp_subst, ntemps);
+	for (int pass = 0; pass < 2; pass++) {
+		recount_uses(ir);
+		memset(temp_subst, 0, sizeof(struct ir *) * ntemps);
+		ir = copy_prop(ir);
+		if (pass == 0) cse(ir);
+	}
+	recount_uses(ir);
+	ir = dce(ir);
+	return float_in(ir);
+}
+
+
+static void
+dump_ir(struct ir *ir, int depth)
+{
+	char *s = NULL;
+	switch (ir->kind) {
+	case IR_LIT:
+		s = obj_tostr(ir->obj);
+		fputs(s, stderr);
+		break;
+	case IR_VAR:
+		fprintf(stderr, ir->raw ? "&%s" : "%s", ir->name);
+		break;
+	case IR_TEMP:
+		fprintf(stderr, "t%d", ir->temp);
+		break;
+	case IR_VOID:
+		fputs("#<void>", stderr);
+		break;
+	case IR_QUOTE:
+		s = obj_tostr(ir->obj);
+		fprintf(stderr, "'%s", s);
+		break;
+	case IR_CALL:
+	case IR_LAMBDA:
+		if (ir->kind == IR_CALL) {
+			fputc('(', stderr);
+			dump_ir(ir->fn, depth);
+		} else {
+			fprintf(stderr, "(lambda %s", func_defs[ir->idx].name);
+		}
+		for (ptrdiff_t i = 0; i < arrlen(ir->args); i++) {
+			fputc(' ', stderr);
+			dump_ir(ir->args[i], depth);
+		}
+		fputc(')', stderr);
+		break;
+	case IR_IF:
+		fputs("(if ", stderr);
+		dump_ir(ir->test, depth);
+		fprintf(stderr, "\n%*s", 2 * depth + 2, "");
+		dump_ir(ir->conseq, depth + 1);
+		fprintf(stderr, "\n%*s", 2 * depth + 2, "");
+		dump_ir(ir->alter, depth + 1);
+		fputc(')', stderr);
+		break;
+	case IR_LET:
+		fprintf(stderr, "(let t%d ", ir->temp);
+		dump_ir(ir->rhs, depth + 1);
+		fprintf(stderr, "\n%*s", 2 * depth, "");
+		dump_ir(ir->body, depth);
+		fputc(')', stderr);
+		break;
+	case IR_ASSIGN:
+		fprintf(stderr, "(set! %s ", ir->name);
+		dump_ir(ir->value, depth);
+		fputc(')', stderr);
+		break;
+	case IR_DISPLAY:
+		fputs("(display ", stderr);
+		dump_ir(ir->value, depth);
+		fputc(')', stderr);
+		break;
+	case IR_IMPORT:
+		fprintf(stderr, "(%s)", ir->name);
+		break;
+	case IR_BIND:
+		fprintf(stderr, "(bind %s ", ir->name);
+		dump_ir(ir->value, depth);
+		fputc(')', stderr);
+		break;
+	case IR_LOOP:
+	case IR_JUMP:
+		fprintf(stderr, "(%s lp_%td (", ir->kind == IR_LOOP ? "loop" : "jump",
+			ir->kind == IR_LOOP ? ir->idx : ir->loop->idx);
+		for (ptrdiff_t i = 0; i < arrlen(ir->args); i++) {
+			if (ir->kind == IR_LOOP) fprintf(stderr, "%s(%s ", i ? " " : "", ir->vars[i]->name);
+			else if (i) fputc(' ', stderr);
+			dump_ir(ir->args[i], depth);
+			if (ir->kind == IR_LOOP) fputc(')', stderr);
+		}
+		fputc(')', stderr);
+		if (ir->kind == IR_LOOP) {
+			fprintf(stderr, "\n%*s", 2 * depth + 2, "");
+			dump_ir(ir->body, depth + 1);
+		}
+		fputc(')', stderr);
+		break;
+	}
+	free(s);
+}
+
+
+/// Emission of the IR. The value of a call or quote bound by a let stays
+/// on the stack while the values pushed above it are consumed, so the
+/// arguments of a call are often in place already. These temporaries are
+/// pending, until they are popped into C variables to be used otherwise.
+static void
+emit_str(char ***out, char *so)
+{
+	char **outarr = *out;
+	arrput(outarr, so);
+	*out = outarr;
+}
+
+
+static char *
+atom_expr(struct ir *a)
+{
+	char *s, *lit, *so;
+	switch (a->kind) {
+	case IR_LIT:
+		if (a->obj->type == TSTRING) {
+			struct string *str = a->obj->pval;
+			lit = c_literal(str->buf->data + str->off, str->len);
+			so = str_fmt("gen_obj_str(%s, %zu)", lit, str->len);
+			free(lit);
+			return so;
+		}
+		s = obj_tostr(a->obj);
+		so = str_fmt("gen_obj_int(%s)", s);
+		free(s);
+		return so;
+	case IR_VAR:
+		return var_ref(a->name, a->raw);
+	case IR_TEMP:
+		return str_fmt("t%d", a->temp);
+	default:
+		return strdup("NULL");
+	}
+}
+
+
+static bool
+is_pending(struct ir *a)
+{
+	if (a->kind != IR_TEMP) return false;
+	for (ptrdiff_t i = 0; i < arrlen(pending); i++) {
+		if (pending[i] == a->temp) return true;
+	}
+	return false;
+}
+
+
+static void
+emit_materialize(char ***out)
+{
+	while (arrlen(pending) > 0) emit_str(out, str_fmt("	struct obj *t%d = pop();\n", arrpop(pending)));
+}
+
+
+/// Leaves the value of the C expression expr at dest, evaluating it for
+/// its effects only if dest is DNONE
+static void
+emit_result(char ***out, int dest, int temp, char *expr, bool effects)
+{
+	switch (dest) {
+	case DPUSH:
+		emit_str(out, str_fmt("	push(%s);\n", expr));
+		break;
+	case DTEMP:
+		emit_str(out, str_fmt("	t%d = %s;\n", temp, expr));
+		break;
+	case DDECL:
+		emit_str(out, str_fmt("	struct obj *t%d = %s;\n", temp, expr));
+		break;
+	default:
+		if (effects) emit_str(out, str_fmt("	%s;\n", expr));
+	}
+}
+
+
+/// Builtins whose calls are open-coded, with their number of arguments
+/// and the C expression for their value or, for predicates, the C
+/// condition
+static const struct {
+	const char *name;
+	int nargs;
+	const char *expr, *cond;
+} open_codes[] = {
+	{ "+", 2, "num_add(%s, %s)", NULL },
+	{ "-", 2, "num_sub(%s, %s)", NULL },
+	{ "*", 2, "num_mul(%s, %s)", NULL },
+	{ "/", 2, "num_div(%s, %s)", NULL },
+	{ "<", 2, NULL, "num_cmp(%s, %s) < 0" },
+	{ ">", 2, NULL, "num_cmp(%s, %s) > 0" },
+	{ "<=", 2, NULL, "num_cmp(%s, %s) <= 0" },
+	{ ">=", 2, NULL, "num_cmp(%s, %s) >= 0" },
+	{ "=", 2, NULL, "num_cmp(%s, %s) == 0" },
+	{ "car", 1, "list_car(%s)", NULL },
+	{ "cdr", 1, "list_cdr(%s)", NULL },
+	{ "null?", 1, NULL, "list_null(%s)" },
+};
+/// Condition of the if that follows, open-coded by the let binding its test
+static struct { int temp; char *cond; } fused_test = { .cond = NULL };
+
+
+/// C expression for the value of e, or the condition if cond isn't NULL,
+/// if e is a call of a builtin that is open-coded, else NULL. Temporaries
+/// on the stack the operands refer to are materialized first.
+static char *
+open_code(char ***out, struct ir *e, bool *cond)
+{
+	/// The profile and allocation statistics count the calls of builtins
+	if (options.profile || options.alloc_stats) return NULL;
+	if (e->kind != IR_CALL || e->fn->kind != IR_VAR || e->fn->var_kind != VGLOBAL) return NULL;
+	if (!global_fixed(e->fn->name)) return NULL;
+	size_t i = 0, n = sizeof(open_codes) / sizeof(open_codes[0]);
+	for (; i < n; i++) {
+		if (strcmp(open_codes[i].name, e->fn->name) == 0 && open_codes[i].nargs == arrlen(e->args)) break;
+	}
+	if (i == n) return NULL;
+	char *args[2] = { NULL, NULL };
+	for (ptrdiff_t j = 0; j < arrlen(e->args); j++) {
+		if (is_pending(e->args[j])) emit_materialize(out);
+	}
+	for (ptrdiff_t j = 0; j < arrlen(e->args); j++) args[j] = atom_expr(e->args[j]);
+	char *so;
+	if (open_codes[i].cond && cond) {
+		*cond = true;
+		so = str_fmt(open_codes[i].cond, args[0], args[1]);
+	} else if (open_codes[i].cond) {
+		char *c = str_fmt(open_codes[i].cond, args[0], args[1]);
+		so = str_fmt("gen_obj_bool(%s)", c);
+		free(c);
+	} else {
+		so = str_fmt(open_codes[i].expr, args[0], args[1]);
+	}
+	free(args[0]);
+	free(args[1]);
+	return so;
+}
+
+
+/// Emits a call of e, leaving its value on the stack
+static void
+emit_call(char ***out, struct ir *e)
+{
+	/// The pending temporaries on top of the stack that are the first
+	/// arguments, in order and used once, are left in place
+	ptrdiff_t nargs = arrlen(e->args), np = arrlen(pending);
+	ptrdiff_t k = np < nargs ? np : nargs;
+	for (; k > 0; k--) {
+		ptrdiff_t i = 0;
+		for (; i < k; i++) {
+			struct ir *a = e->args[i];
+			if (a->kind != IR_TEMP || a->temp != pending[np - k + i] || temp_uses[a->temp] != 1) break;
+		}
+		if (i == k) break;
+	}
+	arrsetlen(pending, np - k);
+	bool reads_pending = is_pending(e->fn);
+	for (ptrdiff_t i = k; i < nargs; i++) reads_pending = reads_pending || is_pending(e->args[i]);
+	if (reads_pending) {
+		arrsetlen(pending, np);
+		emit_materialize(out);
+		k = 0;
+	}
+	for (ptrdiff_t i = k; i < nargs; i++) {
+		char *s = atom_expr(e->args[i]);
+		emit_str(out, str_fmt("	push(%s);\n", s));
+		free(s);
+	}
+	char *fn = atom_expr(e->fn);
+	emit_str(out, str_fmt("	call_obj(%s, %td);\n", fn, nargs));
+	free(fn);
+}
+
+
+static void emit_value(char ***out, struct ir *ir, int dest, int temp);
+
+
+static void
+emit_let(char ***out, struct ir *let)
+{
+	struct ir *rhs = let->rhs;
+	/// The if its value is only used as the test of branches on the
+	/// condition instead
+	struct ir *next = let->body->kind == IR_LET ? let->body->rhs : let->body;
+	bool test = temp_uses[let->temp] == 1 && next->kind == IR_IF && next->test->kind == IR_TEMP
+		&& next->test->temp == let->temp;
+	bool cond = false;
+	char *expr = temp_uses[let->temp] ? open_code(out, rhs, test ? &cond : NULL) : NULL;
+	if (cond) {
+		fused_test.temp = let->temp;
+		fused_test.cond = expr;
+	} else if (temp_uses[let->temp] == 0) {
+		emit_value(out, rhs, DNONE, 0);
+	} else if (expr) {
+		emit_result(out, DDECL, let->temp, expr, true);
+		free(expr);
+	} else if (rhs->kind == IR_CALL || rhs->kind == IR_QUOTE) {
+		emit_value(out, rhs, DPUSH, 0);
+		arrput(pending, let->temp);
+	} else if (rhs->kind == IR_IF || rhs->kind == IR_LOOP) {
+		emit_str(out, str_fmt("	struct obj *t%d;\n", let->temp));
+		emit_value(out, rhs, DTEMP, let->temp);
+	} else {
+		emit_value(out, rhs, DDECL, let->temp);
+	}
+}
+
+
+/// Emits the evaluation of ir, leaving its value at dest
+static void
+emit_value(char ***out, struct ir *ir, int dest, int temp)
+{
+	for (; ir->kind == IR_LET; ir = ir->body) emit_let(out, ir);
+	if (ir->line && ir->line != emitted_line) {
+		emitted_line = ir->line;
+		emit_str(out, str_fmt("#line %d %s\n", ir->line, emit_src));
+	}
+	struct func_def *fd;
+	char *s = NULL, *lit;
+	switch (ir->kind) {
+	case IR_CALL:
+		if ((s = open_code(out, ir, NULL))) {
+			emit_result(out, dest, temp, s, true);
+			break;
+		}
+		emit_call(out, ir);
+		if (dest != DPUSH) emit_result(out, dest, temp, "pop()", true);
+		break;
+	case IR_QUOTE:
+		s = obj_tostr(ir->obj);
+		lit = c_literal(s, strlen(s));
+		emit_str(out, str_fmt("	QUOTE(%s);\n", lit));
+		free(lit);
+		if (dest != DPUSH) emit_result(out, dest, temp, "pop()", true);
+		break;
+	case IR_IF:
+		/// Both branches start with the same stack
+		emit_materialize(out);
+		if (fused_test.cond && ir->test->kind == IR_TEMP && ir->test->temp == fused_test.temp) {
+			emit_str(out, str_fmt("	if (%s) {\n", fused_test.cond));
+			free(fused_test.cond);
+			fused_test.cond = NULL;
+		} else {
+			s = atom_expr(ir->test);
+			emit_str(out, str_fmt("	if (is_true(%s)) {\n", s));
+		}
+		emit_value(out, ir->conseq, dest, temp);
+		emit_str(out, "	} else {\n");
+		emit_value(out, ir->alter, dest, temp);
+		emit_str(out, "	}\n");
+		break;
+	case IR_ASSIGN:
+		/// Assign a local or captured variable, or else define a global.
+		/// Captured variables that are assigned are always boxed.
+		if (is_pending(ir->value)) emit_materialize(out);
+		s = atom_expr(ir->value);
+		if (ir->var_kind == VLOCAL) {
+			emit_str(out, str_fmt(ir->boxed ? "	loc[%td]->pval = %s;\n" : "	loc[%td] = %s;\n", ir->idx, s));
+		} else if (ir->var_kind == VCAPTURED) {
+			emit_str(out, str_fmt("	fv[%td]->pval = %s;\n", ir->idx, s));
+		} else {
+			emit_str(out, str_fmt("	define_global(%s, \"%s\");\n", s, ir->name));
+		}
+		emit_result(out, dest, temp, "NULL", false);
+		break;
+	case IR_DISPLAY:
+		if (is_pending(ir->value)) emit_materialize(out);
+		s = atom_expr(ir->value);
+		emit_str(out, str_fmt("	print_obj(%s);\n", s));
+		emit_result(out, dest, temp, "NULL", false);
+		break;
+	case IR_IMPORT:
+		emit_str(out, str_fmt("	%s();\n", ir->name));
+		emit_result(out, dest, temp, "NULL", false);
+		break;
+	case IR_BIND:
+		/// Each binding of a boxed variable is a new box
+		if (is_pending(ir->value)) emit_materialize(out);
+		s = atom_expr(ir->value);
+		emit_str(out, str_fmt(ir->boxed ? "	loc[%td] = gen_obj_box(%s);\n" : "	loc[%td] = %s;\n", ir->idx, s));
+		emit_result(out, dest, temp, "NULL", false);
+		break;
+	case IR_LOOP:
+		/// The body starts with the same stack in every iteration, it leaves
+		/// the value at dest when it doesn't jump back
+		emit_materialize(out);
+		for (ptrdiff_t i = 0; i < arrlen(ir->args); i++) {
+			struct ir *var = ir->vars[i];
+			char *init = atom_expr(ir->args[i]);
+			emit_str(out, str_fmt(var->boxed ? "	loc[%td] = gen_obj_box(%s);\n" : "	loc[%td] = %s;\n",
+				var->idx, init));
+			free(init);
+		}
+		emit_str(out, str_fmt("lp_%td:;\n", ir->idx));
+		emit_value(out, ir->body, dest, temp);
+		break;
+	case IR_JUMP:
+		/// The arguments are all read before the variables are rebound
+		emit_materialize(out);
+		emit_str(out, "	{\n");
+		for (ptrdiff_t i = 0; i < arrlen(ir->args); i++) {
+			char *arg = atom_expr(ir->args[i]);
+			emit_str(out, str_fmt("	struct obj *a%td = %s;\n", i, arg));
+			free(arg);
+		}
+		for (ptrdiff_t i = 0; i < arrlen(ir->args); i++) {
+			struct ir *var = ir->loop->vars[i];
+			emit_str(out, str_fmt(var->boxed ? "	loc[%td] = gen_obj_box(a%td);\n" : "	loc[%td] = a%td;\n",
+				var->idx, i));
+		}
+		emit_str(out, str_fmt("	goto lp_%td;\n", ir->loop->idx));
+		emit_str(out, "	}\n");
+		break;
+	case IR_LAMBDA:
+		/// Push the captured values, or boxes, then generate the closure
+		for (ptrdiff_t i = 0; i < arrlen(ir->args); i++) {
+			char *ref = atom_expr(ir->args[i]);
+			emit_str(out, str_fmt("	push(%s);\n", ref));
+			free(ref);
+		}
+		fd = &func_defs[ir->idx];
+		s = str_fmt("gen_obj_closure(%s, %td)", fd->name, arrlen(fd->captured));
+		emit_result(out, dest, temp, s, true);
+		break;
+	default:
+		if (ir->kind == IR_TEMP && arrlen(pending) > 0 && arrlast(pending) == ir->temp
+				&& temp_uses[ir->temp] == 1) {
+			/// The value is on top of the stack
+			arrpop(pending);
+			if (dest != DPUSH) emit_result(out, dest, temp, "pop()", true);
+			break;
+		}
+		if (is_pending(ir)) emit_materialize(out);
+		s = atom_expr(ir);
+		emit_result(out, dest, temp, s, false);
+	}
+	free(s);
+}
+
+
+/// Lowers and optimizes a lambda body or the top level
+static struct ir *
+lower_body(struct obj *body, const char *name)
+{
+	ntemps = 0;
+	struct ir *ir = optimize(lower(body));
+	if (options.dump_ir) {
+		fprintf(stderr, ";; %s\n", name);
+		dump_ir(ir, 0);
+		fputc('\n', stderr);
+	}
+	return ir;
+}
+
+
+/// Emits the code of a lambda body or of the top level, leaving its value
+/// on the stack
+static void
+emit_body(char ***out, struct obj *body, const char *name)
+{
+	emit_value(out, lower_body(body, name), DPUSH, 0);
+}
+
+
+static char *
+chop_file_ext(char *file_name)
+{
+	char *dot = strrchr(file_name, '.');
+	char *slash = strrchr(file_name, FILE_SEP);
+	if (!dot || dot < slash) return file_name;
+	char *ret = malloc(dot - file_name + 1);
+	memcpy(ret, file_name, dot - file_name);
+	ret[dot - file_name] = '\0';
+	return ret;
+}
+
+
+static char *
+add_suffix(char *file_base, const char *suffix)
+{
+	char *out_file = malloc(strlen(file_base) + strlen(suffix) + 1);
+	sprintf(out_file, "%s%s", file_base, suffix);
+	return out_file;
+}
+
+
+/// Writes the code. The code of a source line, which follows its #line,
+/// is joined into one line, so it keeps that line number. Where a function
+/// ends, the lines that follow switch back to those of the C file c_lit.
+static void
+write_lines(FILE *f, char **code, const char *c_lit, int *nlines)
+{
+	bool mapped = false;
+	for (ptrdiff_t i = 0; i < arrlen(code); i++) {
+		bool directive = strncmp(code[i], "#line ", 6) == 0;
+		if (mapped && (directive || code[i] == line_reset)) {
+			fputc('\n', f);
+			(*nlines)++;
+		}
+		if (code[i] == line_reset) {
+			*nlines += fprintf(f, "#line %d %s\n", *nlines + 2, c_lit) > 0;
+			mapped = false;
+		} else if (directive) {
+			fputs(code[i], f);
+			(*nlines)++;
+			mapped = true;
+		} else if (mapped) {
+			for (char *c = code[i]; *c; c++) fputc(*c == '\n' ? ' ' : *c, f);
+		} else {
+			fputs(code[i], f);
+			for (char *c = code[i]; (c = strchr(c, '\n')); c++) (*nlines)++;
+		}
+	}
+}
+
+
+/// Writes the translation unit, or header, c_file
+static void
+write_unit(char *c_file, char **code)
+{
+	FILE *f = fopen(c_file, "w");
+	if (!f) panic("could not write '%s'\n", c_file);
+	char *c_lit = c_literal(c_file, strlen(c_file));
+	int nlines = 0;
+	write_lines(f, code, c_lit, &nlines);
+	free(c_lit);
+	compile_stats.emitted_bytes += ftell(f);
+	fclose(f);
+	if (strcmp(c_file + strlen(c_file) - 2, ".c") == 0) arrput(unit_files, c_file);
+}
+
+
+/// Declarations of the caches of global lookups from beg to end. They are
+/// static, so each is in the unit of the code that uses it.
+static void
+emit_caches(char ***out, int beg, int end)
+{
+	for (int i = beg; i < end; i++) {
+		arrput(*out, str_fmt("static _Thread_local struct global_cache gc_%d;\n", i));
+	}
+}
+
+
+/// Number of translation units the lambdas starting at starts are split
+/// into: given by --shards, or else one per core if each gets SHARD_MIN
+/// lambdas. The lambdas of modules are static, so a module is one unit.
+static int
+shard_count(ptrdiff_t *starts)
+{
+	ptrdiff_t nfuncs = arrlen(starts) - 1;
+	if (options.module || nfuncs < 2) return 1;
+	long n = options.shards;
+	if (n <= 0) {
+		n = sysconf(_SC_NPROCESSORS_ONLN);
+		if (n > nfuncs / SHARD_MIN) n = nfuncs / SHARD_MIN;
+	}
+	if (n > nfuncs) n = nfuncs;
+	return n < 1 ? 1 : n;
+}
+
+
+void
+emit(char *file_name, struct obj* ast)
+{
+	char *file_base = chop_file_ext(file_name);
+	if (!file_base) return;
+	char *slash = strrchr(file_name, FILE_SEP);
+	unit_dir = slash ? strndup(file_name, slash - file_name + 1) : "";
+	ast = expand(ast);
+	collect_assigned(ast, &assigned_globals);
+	char *c_file = add_suffix(file_base, ".c");
+	emit_src = c_literal(file_name, strlen(file_name));
+	emit_incl(&func_decls);
+	/// The variables bound at top level are locals of main() or of the
+	/// module's initialization function
+	struct func_def top = { .parms = gen_obj_list(), .body = ast };
+	if (options.module) {
+		emit_module_top(&mainc, file_name);
+	} else {
+		emit_main_top(&mainc);
+	}
+	scope = new_scope(&top, true);
+	if (shlen(scope->locals) > 0) {
+		emit_str(&mainc, str_fmt("	struct obj *loc[%td] = {0};\n", shlen(scope->locals)));
+	}
+	emit_body(&mainc, ast, options.module ? module_init_name(file_name) : "main");
+	emit_str(&mainc, line_reset);
+	scope = NULL;
+	if (options.module) {
+		emit_module_bottom(&mainc);
+	} else {
+		emit_main_bottom(&mainc);
+	}
+	/// Where the code of each lambda starts and the caches of its global
+	/// lookups, which go into the unit it is written to
+	ptrdiff_t *starts = NULL;
+	int *caches = NULL;
+	int main_caches = cache_idx;
+	for (size_t i = 0; i < arrlenu(func_defs); i++) {
+		arrput(starts, arrlen(funcs));
+		arrput(caches, cache_idx);
+		emit_lambda_def(&funcs, &func_defs[i]);
+	}
+	arrput(starts, arrlen(funcs));
+	arrput(caches, cache_idx);
+	if (options.profile || options.alloc_stats) {
+		emit_register_names(&funcs);
+	}
+	for (size_t i = 0; i < arrlenu(func_defs); i++) {
+		emit_lambda_decl(&func_decls, func_defs[i].name);
+	}
+	if (options.profile || options.alloc_stats) {
+		arrput(func_decls, options.module ? "static void register_names(void);\n" : "void register_names(void);\n");
+	}
+	int nshards = shard_count(starts);
+	compile_stats.lambdas = arrlenu(func_defs);
+	compile_stats.units = nshards;
+	compile_stats.emitted_bytes = 0;
+	arrsetlen(unit_files, 0);
+	unit_header = NULL;
+	if (nshards == 1) {
+		char **code = NULL;
+		for (ptrdiff_t i = 0; i < arrlen(func_decls); i++) arrput(code, func_decls[i]);
+		emit_caches(&code, 0, cache_idx);
+		for (ptrdiff_t i = 0; i < arrlen(funcs); i++) arrput(code, funcs[i]);
+		for (ptrdiff_t i = 0; i < arrlen(mainc); i++) arrput(code, mainc[i]);
+		write_unit(c_file, code);
+		arrfree(code);
+	} else {
+		/// The lambdas are split into runs of about equal size, the first
+		/// goes with main() and the registration of the names
+		unit_header = add_suffix(file_base, ".h");
+		write_unit(unit_header, func_decls);
+		char *base = strrchr(unit_header, FILE_SEP);
+		char *incl = str_fmt("#include \"%s\"\n\n", base ? base + 1 : unit_header);
+		size_t nfuncs = arrlenu(func_defs);
+		ptrdiff_t size = starts[nfuncs] - starts[0], beg = 0;
+		for (int k = 0; k < nshards; k++) {
+			ptrdiff_t end = beg + 1;
+			while (end < (ptrdiff_t)nfuncs && (ptrdiff_t)nfuncs - end > nshards - k - 1
+				&& starts[end] - starts[0] < size * (k + 1) / nshards) end++;
+			if (k == nshards - 1) end = nfuncs;
+			char **code = NULL;
+			arrput(code, incl);
+			if (k == 0) emit_caches(&code, 0, main_caches);
+			emit_caches(&code, caches[beg], caches[end]);
+			for (ptrdiff_t i = starts[beg]; i < starts[end]; i++) arrput(code, funcs[i]);
+			if (k == 0) {
+				for (ptrdiff_t i = starts[nfuncs]; i < arrlen(funcs); i++) arrput(code, funcs[i]);
+				for (ptrdiff_t i = 0; i < arrlen(mainc); i++) arrput(code, mainc[i]);
+				write_unit(c_file, code);
+			} else {
+				char *suffix = str_fmt(".%d.c", k);
+				write_unit(add_suffix(file_base, suffix), code);
+				free(suffix);
+			}
+			arrfree(code);
+			beg = end;
+		}
+	}
+	arrfree(starts);
+	arrfree(caches);
+}
+
+
+/// Runs the shell commands cmds, as many at a time as there are cores,
+/// returns whether all of them succeeded
+static bool
+run_parallel(char **cmds)
+{
+	long ncores = sysconf(_SC_NPROCESSORS_ONLN);
+	long running = 0;
+	bool ok = true;
+	fflush(NULL);
+	for (ptrdiff_t i = 0; i < arrlen(cmds) || running > 0;) {
+		if (i < arrlen(cmds) && running < ncores) {
+			pid_t pid = fork();
+			if (pid == 0) {
+				execl("/bin/sh", "sh", "-c", cmds[i], (char *)NULL);
+				_exit(127);
+			}
+			if (pid < 0) ok = false;
+			else running++;
+			i++;
+		} else {
+			int status;
+			if (wait(&status) < 0) break;
+			running--;
+			ok = ok && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+		}
+	}
+	return ok;
+}
+
+
+void
+build(char *file_name)
+{
+	char *file_base = chop_file_ext(file_name);
+	struct port cmd = { .f = NULL, .buf = NULL };
+	port_puts(&cmd, "cc -g -I. -pthread ");
+	if (options.sanitize) port_puts(&cmd, SANITIZE_FLAGS " ");
+	if (options.module) {
+		port_puts(&cmd, "-c -o ");
+		put_word(&cmd, add_suffix(file_base, ".o"));
+		put_word(&cmd, add_suffix(file_base, ".c"));
+	} else {
+		if (system(options.sanitize ? "make runtime-san.o" : "make") != 0) panic("could not build the runtime\n");
+		port_puts(&cmd, "-o ");
+		put_word(&cmd, file_base);
+		if (unit_header) {
+			/// The units are compiled concurrently, then linked
+			char **cmds = NULL;
+			for (ptrdiff_t i = 0; i < arrlen(unit_files); i++) {
+				char *obj = add_suffix(chop_file_ext(unit_files[i]), ".o");
+				char *qobj = shell_quote(obj), *qsrc = shell_quote(unit_files[i]);
+				arrput(cmds, str_fmt("cc -g -I. -pthread %s-c -o %s %s",
+					options.sanitize ? SANITIZE_FLAGS " " : "", qobj, qsrc));
+				free(qobj);
+				free(qsrc);
+				put_word(&cmd, obj);
+			}
+			if (!run_parallel(cmds)) panic("could not compile '%s'\n", file_name);
+			for (ptrdiff_t i = 0; i < arrlen(cmds); i++) free(cmds[i]);
+			arrfree(cmds);
+		} else {
+			put_word(&cmd, add_suffix(file_base, ".c"));
+		}
+		for (ptrdiff_t i = 0; i < arrlen(link_objs); i++) put_word(&cmd, link_objs[i]);
+		port_puts(&cmd, options.sanitize ? "runtime-san.o -lgmp" : "runtime.o -lgmp");
+	}
+	port_putc(&cmd, '\0');
+	if (system(cmd.buf) != 0) panic(options.module ? "could not compile '%s'\n" : "could not link '%s'\n", file_name);
+	arrfree(cmd.buf);
+}
+
+
+void
+write_interface(char *file_name, struct obj *ast)
+{
+	FILE *f = fopen(add_suffix(chop_file_ext(file_name), ".scmi"), "w");
+	if (!f) panic("could not write the interface of '%s'\n", file_name);
+	struct name_set *exports = NULL;
+	collect_defines(ast, &exports);
+	fprintf(f, "init %s\n", module_init_name(file_name));
+	char *flags = module_flags();
+	fprintf(f, "flags%s\n", flags);
+	free(flags);
+	for (ptrdiff_t i = 0; i < shlen(unit_imports); i++) fprintf(f, "import %s\n", unit_imports[i].key);
+	for (ptrdiff_t i = 0; i < shlen(exports); i++) fprintf(f, "export %s\n", exports[i].key);
+	shfree(exports);
+	fclose(f);
+}
+
+
+/// In-process interpreter
+static struct obj *
+run_lit(struct code *c, struct frame *f)
+{
+	(void)f;
+	return c->obj;
+}
+
+
+static struct obj *
+run_void(struct code *c, struct frame *f)
+{
+	(void)c;
+	(void)f;
+	return NULL;
+}
+
+
+static struct obj *
+run_local(struct code *c, struct frame *f)
+{
+	return f->loc[c->idx];
+}
+
+
+static struct obj *
+run_local_box(struct code *c, struct frame *f)
+{
+	return BOX_REF(f->loc[c->idx]);
+}
+
+
+static struct obj *
+run_captured(struct code *c, struct frame *f)
+{
+	return f->fv[c->idx];
+}
+
+
+static struct obj *
+run_captured_box(struct code *c, struct frame *f)
+{
+	return BOX_REF(f->fv[c->idx]);
+}
+
+
+static struct obj *
+run_temp(struct code *c, struct frame *f)
+{
+	return f->tmp[c->idx];
+}
+
+
+static struct obj *
+run_global(struct code *c, struct frame *f)
+{
+	(void)f;
+	if (c->idx >= arrlen(run_caches)) {
+		/// The caches of code translated since the thread last looked,
+		/// maybe by another thread, which may still be translating
+		ptrdiff_t n = arrlen(run_caches), len = n * 2 > c->idx ? n * 2 : c->idx + 1;
+		arrsetlen(run_caches, len);
+		memset(run_caches + n, 0, sizeof(struct global_cache) * (len - n));
+	}
+	return GLOBAL_REF(run_caches[c->idx], c->name, c->builtin);
+}
+
+
+static struct obj *
+run_quote(struct code *c, struct frame *f)
+{
+	(void)f;
+	QUOTE(c->datum);
+	return pop();
+}
+
+
+static struct obj *
+run_call(struct code *c, struct frame *f)
+{
+	ptrdiff_t nargs = arrlen(c->args);
+	for (ptrdiff_t i = 0; i < nargs; i++) push(c->args[i]->run(c->args[i], f));
+	call_obj(c->fn->run(c->fn, f), nargs);
+	return pop();
+}
+
+
+static struct obj *
+run_if(struct code *c, struct frame *f)
+{
+	struct code *branch = is_true(c->test->run(c->test, f)) ? c->conseq : c->alter;
+	return branch->run(branch, f);
+}
+
+
+static struct obj *
+run_let(struct code *c, struct frame *f)
+{
+	for (; c->run == run_let; c = c->body) f->tmp[c->idx] = c->rhs->run(c->rhs, f);
+	return c->run(c, f);
+}
+
+
+static struct obj *
+run_assign(struct code *c, struct frame *f)
+{
+	struct obj *value = c->value->run(c->value, f);
+	switch (c->var_kind) {
+	case VLOCAL:
+		if (c->boxed) f->loc[c->idx]->pval = value;
+		else f->loc[c->idx] = value;
+		break;
+	case VCAPTURED:
+		f->fv[c->idx]->pval = value;
+		break;
+	default:
+		define_global(value, c->name);
+	}
+	return NULL;
+}
+
+
+static struct obj *
+run_display(struct code *c, struct frame *f)
+{
+	print_obj(c->value->run(c->value, f));
+	return NULL;
+}
+
+
+static struct obj *run_unit(struct obj *ast, char *file_name);
+
+
+static struct obj *
+run_import(struct code *c, struct frame *f)
+{
+	(void)f;
+	if (has_name(modules_run, c->name)) return NULL;
+	add_name(&modules_run, c->name);
+	run_unit(shget(run_modules, c->name), c->name);
+	return NULL;
+}
+
+
+static void run_closure(int nargs);
+
+
+static struct obj *
+run_lambda(struct code *c, struct frame *f)
+{
+	push(&c->lambda->self);
+	for (ptrdiff_t i = 0; i < arrlen(c->args); i++) push(c->args[i]->run(c->args[i], f));
+	return gen_obj_closure(run_closure, arrlen(c->args) + 1);
+}
+
+
+static struct obj *
+run_bind(struct code *c, struct frame *f)
+{
+	struct obj *value = c->value->run(c->value, f);
+	f->loc[c->idx] = c->boxed ? gen_obj_box(value) : value;
+	return NULL;
+}
+
+
+static struct obj *
+run_loop(struct code *c, struct frame *f)
+{
+	/// The body returns the loop's object when it jumps back
+	for (ptrdiff_t i = 0; i < arrlen(c->args); i++) {
+		struct obj *init = c->args[i]->run(c->args[i], f);
+		f->loc[c->vars[i]->idx] = c->vars[i]->boxed ? gen_obj_box(init) : init;
+	}
+	struct obj *value;
+	while ((value = c->body->run(c->body, f)) == &c->self);
+	return value;
+}
+
+
+static struct obj *
+run_jump(struct code *c, struct frame *f)
+{
+	ptrdiff_t nargs = arrlen(c->args);
+	struct obj *values[nargs + 1];
+	for (ptrdiff_t i = 0; i < nargs; i++) values[i] = c->args[i]->run(c->args[i], f);
+	for (ptrdiff_t i = 0; i < nargs; i++) {
+		struct code *var = c->loop->vars[i];
+		f->loc[var->idx] = var->boxed ? gen_obj_box(values[i]) : values[i];
+	}
+	return &c->loop->self;
+}
+
+
+/// Runs the code of a lambda or of the top level with the captured
+/// variables fv, popping the arguments
+static struct obj *
+run_code(struct code *lam, struct obj **fv)
+{
+	struct obj *loc[lam->nlocals + 1], *tmp[lam->ntemps + 1];
+	memset(loc, 0, sizeof(loc));
+	for (ptrdiff_t i = lam->nparms - 1; i >= 0; i--) {
+		loc[i] = lam->local_boxed[i] ? gen_obj_box(pop()) : pop();
+	}
+	for (ptrdiff_t i = lam->nparms; i < lam->let_base; i++) {
+		if (lam->local_boxed[i]) loc[i] = gen_obj_box(NULL);
+	}
+	struct frame f = { .loc = loc, .fv = fv, .tmp = tmp };
+	return lam->body->run(lam->body, &f);
+}
+
+
+static void
+run_closure(int nargs)
+{
+	/// The first captured value of an interpreted lambda is its code
+	(void)nargs;
+	struct obj **vars = closure_vars();
+	push(run_code(vars[0]->pval, vars + 1));
+}
+
+
+static struct code *
+lambda_code(ptrdiff_t idx)
+{
+	while (arrlen(lambda_codes) <= idx) arrput(lambda_codes, NULL);
+	if (!lambda_codes[idx]) {
+		lambda_codes[idx] = calloc(1, sizeof(struct code));
+		lambda_codes[idx]->self.type = TLAST;
+		lambda_codes[idx]->self.pval = lambda_codes[idx];
+	}
+	return lambda_codes[idx];
+}
+
+
+/// Translates ir to code
+static struct code *
+prep(struct ir *ir)
+{
+	struct code *c = calloc(1, sizeof(struct code));
+	switch (ir->kind) {
+	case IR_LIT:
+		c->run = run_lit;
+		c->obj = ir->obj;
+		break;
+	case IR_VAR:
+		c->idx = ir->idx;
+		c->boxed = ir->boxed;
+		if (ir->var_kind == VLOCAL) {
+			c->run = ir->boxed && !ir->raw ? run_local_box : run_local;
+		} else if (ir->var_kind == VCAPTURED) {
+			c->run = ir->boxed && !ir->raw ? run_captured_box : run_captured;
+		} else {
+			c->run = run_global;
+			c->name = ir->name;
+			c->builtin = builtin_index(ir->name);
+			c->idx = cache_idx++;
+		}
+		break;
+	case IR_TEMP:
+		c->run = run_temp;
+		c->idx = ir->temp;
+		break;
+	case IR_VOID:
+		c->run = run_void;
+		break;
+	case IR_QUOTE:
+		c->run = run_quote;
+		c->datum = obj_tostr(ir->obj);
+		break;
+	case IR_CALL:
+		c->run = run_call;
+		c->fn = prep(ir->fn);
+		for (ptrdiff_t i = 0; i < arrlen(ir->args); i++) arrput(c->args, prep(ir->args[i]));
+		break;
+	case IR_IF:
+		c->run = run_if;
+		c->test = prep(ir->test);
+		c->conseq = prep(ir->conseq);
+		c->alter = prep(ir->alter);
+		break;
+	case IR_LET: {
+		/// A let chain is as long as the body it was lowered from, so it
+		/// is prepared in a loop, not recursively
+		struct code *last = c;
+		for (;;) {
+			last->run = run_let;
+			last->idx = ir->temp;
+			last->rhs = prep(ir->rhs);
+			ir = ir->body;
+			if (ir->kind != IR_LET) break;
+			last->body = calloc(1, sizeof(struct code));
+			last = last->body;
+		}
+		last->body = prep(ir);
+		break;
+	}
+	case IR_ASSIGN:
+	case IR_BIND:
+		c->run = ir->kind == IR_ASSIGN ? run_assign : run_bind;
+		c->var_kind = ir->var_kind;
+		c->idx = ir->idx;
+		c->boxed = ir->boxed;
+		c->name = ir->name;
+		c->value = prep(ir->value);
+		break;
+	case IR_DISPLAY:
+		c->run = run_display;
+		c->value = prep(ir->value);
+		break;
+	case IR_IMPORT:
+		c->run = run_import;
+		c->name = ir->name;
+		break;
+	case IR_LAMBDA:
+		c->run = run_lambda;
+		c->lambda = lambda_code(ir->idx);
+		for (ptrdiff_t i = 0; i < arrlen(ir->args); i++) arrput(c->args, prep(ir->args[i]));
+		break;
+	case IR_LOOP:
+		c->run = run_loop;
+		for (ptrdiff_t i = 0; i < arrlen(ir->args); i++) {
+			arrput(c->args, prep(ir->args[i]));
+			arrput(c->vars, prep(ir->vars[i]));
+		}
+		hmput(loop_codes, ir, c);
+		c->body = prep(ir->body);
+		break;
+	case IR_JUMP:
+		c->run = run_jump;
+		c->loop = hmget(loop_codes, ir->loop);
+		for (ptrdiff_t i = 0; i < arrlen(ir->args); i++) arrput(c->args, prep(ir->args[i]));
+		break;
+	}
+	return c;
+}
+
+
+/// Translates the body of a lambda, or the top level, to lam
+static void
+prep_lambda(struct code *lam, struct func_def fd, bool top, const char *name)
+{
+	struct scope *sc = new_scope(&fd, top);
+	struct scope *enclosing = scope;
+	scope = sc;
+	char *enclosing_name = cur_src_name;
+	cur_src_name = fd.src_name;
+	lam->body = prep(lower_body(fd.body, name));
+	cur_src_name = enclosing_name;
+	scope = enclosing;
+	lam->nparms = arrlen((struct obj **)fd.parms->pval);
+	lam->nlocals = shlen(sc->locals);
+	lam->ntemps = ntemps;
+	lam->let_base = sc->let_base;
+	lam->local_boxed = sc->local_boxed;
+}
+
+
+/// State of the compiler when it was taken. A panic() abandons the lambdas
+/// lowered since and the lowering in progress, compile_rollback() drops
+/// them, so the code compiled later doesn't run into them.
+static struct {
+	ptrdiff_t nfunc_defs, nprepped, nrenames, nloops, ncse;
+	int label_idx, cache_idx, loop_idx, cur_line;
+	struct scope *scope;
+	char *binding_name, *cur_src_name, *unit_dir;
+} compile_saved;
+
+
+/// Takes the compiler for the thread, until compile_end() or a panic()
+static void
+compile_begin(void)
+{
+	pthread_mutex_lock(&compile_lock);
+	compiling = true;
+	compile_saved.nfunc_defs = arrlen(func_defs);
+	compile_saved.nprepped = nprepped;
+	compile_saved.nrenames = arrlen(renames);
+	compile_saved.nloops = arrlen(loops);
+	compile_saved.ncse = arrlen(cse_avail);
+	compile_saved.label_idx = label_idx;
+	compile_saved.cache_idx = cache_idx;
+	compile_saved.loop_idx = loop_idx;
+	compile_saved.cur_line = cur_line;
+	compile_saved.scope = scope;
+	compile_saved.binding_name = binding_name;
+	compile_saved.cur_src_name = cur_src_name;
+	compile_saved.unit_dir = unit_dir;
+}
+
+
+static void
+compile_end(void)
+{
+	compiling = false;
+	pthread_mutex_unlock(&compile_lock);
+}
+
+
+static void
+compile_rollback(void)
+{
+	arrsetlen(func_defs, compile_saved.nfunc_defs);
+	nprepped = compile_saved.nprepped;
+	arrsetlen(renames, compile_saved.nrenames);
+	arrsetlen(loops, compile_saved.nloops);
+	arrsetlen(cse_avail, compile_saved.ncse);
+	hmfree(cse_latest);
+	label_idx = compile_saved.label_idx;
+	cache_idx = compile_saved.cache_idx;
+	loop_idx = compile_saved.loop_idx;
+	cur_line = compile_saved.cur_line;
+	scope = compile_saved.scope;
+	binding_name = compile_saved.binding_name;
+	cur_src_name = compile_saved.cur_src_name;
+	unit_dir = compile_saved.unit_dir;
+	compile_end();
+}
+
+
+/// Translates the top level of a program or module in file_name, and the
+/// lambdas in it, then runs it and returns its value
+static struct obj *
+run_unit(struct obj *ast, char *file_name)
+{
+	compile_begin();
+	char *importer_dir = unit_dir;
+	char *slash = strrchr(file_name, FILE_SEP);
+	unit_dir = slash ? strndup(file_name, slash - file_name + 1) : "";
+	struct code *unit = calloc(1, sizeof(struct code));
+	struct func_def top = { .parms = gen_obj_list(), .body = ast };
+	prep_lambda(unit, top, true, file_name);
+	for (; nprepped < arrlen(func_defs); nprepped++) {
+		prep_lambda(lambda_code(nprepped), func_defs[nprepped], false, func_defs[nprepped].src_name);
+		/// The reports name interpreted lambdas by their code, see call_obj()
+		if (prof_enabled || alloc_enabled) name_fn((func *)lambda_code(nprepped), func_defs[nprepped].src_name);
+	}
+	unit_dir = importer_dir;
+	compile_end();
+	return run_code(unit, NULL);
+}
+
+
+void
+run(char *file_name, struct obj *ast)
+{
+	ast = expand(ast);
+	collect_assigned(ast, &assigned_globals);
+	if (options.alloc_stats) alloc_stats_init();
+	if (options.profile) prof_init();
+	run_unit(ast, file_name);
+}
+
+
+/// Embedding API
+
+static pthread_once_t runtime_once = PTHREAD_ONCE_INIT;
+
+
+static void
+runtime_init_once(void)
+{
+	init_runtime();
+}
+
+
+static _Noreturn void
+scm_panic(const char *fmt, ...)
+{
+	va_list ap;
+	va_start(ap, fmt);
+	if (!on_error) {
+		vfprintf(stderr, fmt, ap);
+		va_end(ap);
+		exit(EXIT_FAILURE);
+	}
+	int len = vsnprintf(NULL, 0, fmt, ap);
+	va_end(ap);
+	char *error = malloc(len + 1);
+	va_start(ap, fmt);
+	vsnprintf(error, len + 1, fmt, ap);
+	va_end(ap);
+	/// The error is returned without its newline
+	if (len > 0 && error[len - 1] == '\n') error[len - 1] = '\0';
+	free(on_error->error);
+	on_error->error = error;
+	/// The generators resumed since the handler was set up never return
+	/// to their resumers, they are finished
+	for (struct generator *g = gen_cur; g && g != on_error->gen; g = g->resumer) {
+		g->state = GDONE;
+		g->value = &eof_obj;
+		arrput(gen_abandoned, g);
+	}
+	gen_cur = on_error->gen;
+	longjmp(on_error->buf, 1);
+}
+
+
+struct scm_ctx *
+scm_ctx_new(void)
+{
+	pthread_once(&runtime_once, runtime_init_once);
+	struct scm_ctx *ctx = calloc(1, sizeof(struct scm_ctx));
+	ctx->env.version = new_version();
+	return ctx;
+}
+
+
+void
+scm_ctx_free(struct scm_ctx *ctx)
+{
+	/// Objects are not freed, the runtime has no collector
+	shfree(ctx->env.e);
+	shfree(ctx->modules_run);
+	free(ctx->stack);
+	free(ctx->error);
+	free(ctx);
+}
+
+
+const char *
+scm_error(struct scm_ctx *ctx)
+{
+	return ctx->error;
+}
+
+
+/// State of the thread while it runs in a context
+struct ctx_saved {
+	struct scm_ctx *ctx;
+	struct handler *on_error;
+	struct envt *env;
+	unsigned long int global_version;
+	struct obj **stack;
+	int stack_cap, sp;
+	struct name_set *modules_run;
+};
+
+
+/// Makes ctx current on the thread, unless the thread is in it already,
+/// when called back from the program
+static void
+ctx_enter(struct scm_ctx *ctx, struct ctx_saved *saved, struct handler *h)
+{
+	*saved = (struct ctx_saved){ .ctx = cur_ctx, .on_error = on_error, .env = env,
+		.global_version = global_version, .stack = stack, .stack_cap = stack_cap,
+		.sp = sp, .modules_run = modules_run };
+	free(ctx->error);
+	ctx->error = NULL;
+	on_error = h;
+	if (cur_ctx != ctx) {
+		cur_ctx = ctx;
+		env = &ctx->env;
+		global_version = ctx->env.version;
+		stack = ctx->stack;
+		stack_cap = ctx->stack_cap;
+		sp = ctx->sp;
+		modules_run = ctx->modules_run;
+	}
+	*h = (struct handler){ .gen = gen_cur, .sp = sp, .error = NULL };
+}
+
+
+static void
+ctx_leave(struct scm_ctx *ctx, struct ctx_saved *saved)
+{
+	port_flush(&out_port);
+	on_error = saved->on_error;
+	if (saved->ctx == ctx) return;
+	ctx->stack = stack;
+	ctx->stack_cap = stack_cap;
+	ctx->sp = sp;
+	ctx->modules_run = modules_run;
+	cur_ctx = saved->ctx;
+	env = saved->env;
+	global_version = saved->global_version;
+	stack = saved->stack;
+	stack_cap = saved->stack_cap;
+	sp = saved->sp;
+	modules_run = saved->modules_run;
+}
+
+
+/// After a panic() returned to h, the compiler is rolled back and
+/// released, the values pushed since h was set up are dropped and the
+/// stacks of the generators abandoned unmapped
+static void
+panic_recover(struct handler *h)
+{
+	if (compiling) compile_rollback();
+	while (sp > h->sp) stack[sp--] = NULL;
+	for (ptrdiff_t i = 0; i < arrlen(gen_abandoned); i++) {
+		struct generator *g = gen_abandoned[i];
+		munmap(g->cstack, CO_STACK);
+		g->cstack = NULL;
+		arrfree(g->vals);
+		arrfree(g->frames);
+	}
+	arrsetlen(gen_abandoned, 0);
+}
+
+
+bool
+scm_eval(struct scm_ctx *ctx, const char *src, struct obj **value)
+{
+	struct ctx_saved saved;
+	struct handler h;
+	ctx_enter(ctx, &saved, &h);
+	bool ok = true;
+	if (setjmp(h.buf) == 0) {
+		/// The source is kept, the locations of the code refer to it
+		char *text = strdup(src), *pos = text;
+		struct obj *root = gen_obj_list();
+		sexp_append_obj_inplace(root, gen_obj_symb("begin"));
+		compile_begin();
+		parse_source("<eval>", text);
+		int t_type;
+		while ((t_type = parse(&root, &pos)) != TOKEOS) {
+			if (t_type == TOKPARR) panic("unexpected ')'\n");
+		}
+		struct obj *ast = expand(root);
+		collect_assigned(ast, &assigned_globals);
+		compile_end();
+		struct obj *res = run_unit(ast, "<eval>");
+		if (value) *value = res;
+	} else {
+		panic_recover(&h);
+		ctx->error = h.error;
+		ok = false;
+	}
+	ctx_leave(ctx, &saved);
+	return ok;
+}
+
+
+bool
+scm_call(struct scm_ctx *ctx, struct obj *proc, int nargs, struct obj **args, struct obj **value)
+{
+	struct ctx_saved saved;
+	struct handler h;
+	ctx_enter(ctx, &saved, &h);
+	bool ok = true;
+	if (setjmp(h.buf) == 0) {
+		for (int i = 0; i < nargs; i++) push(args[i]);
+		call_obj(proc, nargs);
+		struct obj *res = pop();
+		if (value) *value = res;
+	} else {
+		panic_recover(&h);
+		ctx->error = h.error;
+		ok = false;
+	}
+	ctx_leave(ctx, &saved);
+	return ok;
+}
+
+
+/// Functions for generating objects
+
+struct obj *
+gen_obj_bool(bool op)
+{
+	struct obj *res = scm_alloc(sizeof(struct obj), TBOOL);
+	res->type = TBOOL;
+	res->pval = scm_alloc(sizeof(bool), TBOOL);
+	res->vars = NULL;
+	*(bool *)res->pval = op;
+	return res;
+}
+
+
+struct obj *
+gen_obj_int(long int op)
+{
+	struct obj *res = scm_alloc(sizeof(struct obj), TNUM);
+	res->type = TNUM;
+	res->pval = scm_alloc(sizeof(mpf_t), TNUM);
+	res->vars = NULL;
+	mpf_init2(res->pval, FLOAT_PREC);
+	if (op >= 0) {
+		mpf_set_ui(res->pval, op);
+	} else {
+		mpf_set_si(res->pval, op);
+	}
+	return res;
+}
+
+
+struct obj *
+gen_obj_int_strview(struct strview op)
+{
+	struct obj *res = scm_alloc(sizeof(struct obj), TNUM);
+	res->type = TNUM;
+	res->pval = scm_alloc(sizeof(mpf_t), TNUM);
+	res->vars = NULL;
+	char *opstr = str_from_strview(op);
+	mpf_init2(res->pval, FLOAT_PREC);
+	mpf_set_str(res->pval, opstr, 10);
+	free(opstr);
+	return res;
+}
+
+
+struct obj *
+gen_obj_symb(char *symb)
+{
+	struct obj *res = scm_alloc(sizeof(struct obj), TSYMB);
+	res->type = TSYMB;
+	size_t symb_len = strlen(symb) + 1;
+	res->pval = scm_alloc(symb_len, TSYMB);
+	memcpy(res->pval, symb, symb_len);
+	res->vars = NULL;
+	return res;
+}
+
+
+// struct obj *
+// gen_obj_fract(long int nom, long int den)
+// {
+	// struct obj *res = malloc(sizeof(struct obj));
 	// res->type = TNUM;
 	// res->pval = malloc(sizeof(mpq_t));
-	// res->envidx = 0;
+	// res->vars = NULL;
 	// if (op >= 0) {
 		// mpq_init_set_ui(res->pval, nom, den);
 	// } else {
@@ -619,278 +3821,2133 @@ gen_obj_symb(char *symb)
 // }
 
 
-struct obj *
-gen_obj_float(long int op)
+struct obj *
+gen_obj_float(long int op)
+{
+	struct obj *res = scm_alloc(sizeof(struct obj), TNUM);
+	res->type = TNUM;
+	res->pval = scm_alloc(sizeof(mpf_t), TNUM);
+	res->vars = NULL;
+	mpf_init2(res->pval, FLOAT_PREC);
+	if (op >= 0) {
+		mpf_set_ui(res->pval, op);
+	} else {
+		mpf_set_si(res->pval, op);
+	}
+	return res;
+}
+
+
+struct obj *
+gen_obj_list(void)
+{
+	struct obj *res = scm_alloc(sizeof(struct obj), TLIST);
+	res->type = TLIST;
+	res->pval = NULL;
+	res->vars = NULL;
+	return res;
+}
+
+
+struct obj *
+gen_obj_fn(func fn)
+{
+	struct obj *res = scm_alloc(sizeof(struct obj), TFUNC);
+	res->type = TFUNC;
+	res->pval = (func*)fn;
+	res->vars = NULL;
+	return res;
+}
+
+
+struct obj *
+gen_obj_closure(func fn, int nvars)
+{
+	/// The values of the captured variables are on the stack, the last on top
+	struct obj *res = gen_obj_fn(fn);
+	if (nvars == 0) return res;
+	res->vars = scm_alloc(sizeof(struct obj *) * nvars, TFUNC);
+	for (int i = nvars - 1; i >= 0; i--) res->vars[i] = pop();
+	return res;
+}
+
+
+struct obj *
+gen_obj_box(struct obj *value)
+{
+	struct obj *res = scm_alloc(sizeof(struct obj), TBOX);
+	res->type = TBOX;
+	res->pval = value;
+	res->vars = NULL;
+	return res;
+}
+
+
+struct obj *
+gen_obj_hashtable(void)
+{
+	struct obj *res = scm_alloc(sizeof(struct obj), THASH);
+	res->type = THASH;
+	struct hashtable *ht = scm_alloc(sizeof(struct hashtable), THASH);
+	ht->cap = HT_MINCAP;
+	ht->count = 0;
+	ht->used = 0;
+	ht->slots = scm_alloc(ht->cap * sizeof(struct htslot), THASH);
+	memset(ht->slots, 0, ht->cap * sizeof(struct htslot));
+	res->pval = ht;
+	res->vars = NULL;
+	return res;
+}
+
+
+struct obj *
+gen_obj_str(const char *s, size_t len)
+{
+	/// The string shares the storage of s, which must not change
+	struct strbuf *buf = scm_alloc(sizeof(struct strbuf), TSTRING);
+	buf->data = (char *)s;
+	buf->len = len;
+	buf->cap = 0;
+	struct string *str = scm_alloc(sizeof(struct string), TSTRING);
+	*str = (struct string){ .buf = buf, .off = 0, .len = len };
+	struct obj *res = scm_alloc(sizeof(struct obj), TSTRING);
+	res->type = TSTRING;
+	res->pval = str;
+	res->vars = NULL;
+	return res;
+}
+
+
+static struct obj *
+gen_obj_strview(struct strbuf *buf, size_t off, size_t len)
+{
+	struct string *str = scm_alloc(sizeof(struct string), TSTRING);
+	*str = (struct string){ .buf = buf, .off = off, .len = len };
+	struct obj *res = scm_alloc(sizeof(struct obj), TSTRING);
+	res->type = TSTRING;
+	res->pval = str;
+	res->vars = NULL;
+	return res;
+}
+
+
+/// String operations
+
+static char *
+str_data(struct string *str)
+{
+	return str->buf->data + str->off;
+}
+
+
+static int
+str_cmp(struct string *a, struct string *b)
+{
+	size_t len = a->len < b->len ? a->len : b->len;
+	int r = memcmp(str_data(a), str_data(b), len);
+	if (r) return r;
+	return (a->len > b->len) - (a->len < b->len);
+}
+
+
+static struct string *
+to_string(struct obj *obj, const char *who)
+{
+	if (!obj || obj->type != TSTRING) panic("%s: argument is not a string\n", who);
+	return obj->pval;
+}
+
+
+/// Hash table operations
+
+static size_t
+hash_bytes(const void *p, size_t len)
+{
+	/// FNV-1a
+	const unsigned char *b = p;
+	size_t h = 14695981039346656037UL;
+	for (size_t i = 0; i < len; i++) {
+		h ^= b[i];
+		h *= 1099511628211UL;
+	}
+	return h;
+}
+
+
+static size_t
+hash_obj(struct obj *obj)
+{
+	long int num;
+	double d;
+	switch(obj->type) {
+	case TBOOL:
+		return *(bool *)obj->pval ? 1 : 2;
+	case TNUM:
+		if (mpf_integer_p(obj->pval) && mpf_fits_slong_p(obj->pval)) {
+			num = mpf_get_si(obj->pval);
+			return hash_bytes(&num, sizeof(num));
+		}
+		d = mpf_get_d(obj->pval);
+		return hash_bytes(&d, sizeof(d));
+	case TSYMB:
+		return hash_bytes(obj->pval, strlen(obj->pval));
+	case TSTRING:
+		return hash_bytes(str_data(obj->pval), ((struct string *)obj->pval)->len);
+	default:
+		/// Everything else is hashed by identity
+		return hash_bytes(&obj, sizeof(obj));
+	}
+}
+
+
+static bool
+key_equal(struct obj *a, struct obj *b)
+{
+	if (a == b) return true;
+	if (a->type != b->type) return false;
+	switch(a->type) {
+	case TBOOL:
+		return *(bool *)a->pval == *(bool *)b->pval;
+	case TNUM:
+		return mpf_cmp(a->pval, b->pval) == 0;
+	case TSYMB:
+		return strcmp(a->pval, b->pval) == 0;
+	case TSTRING:
+		return str_cmp(a->pval, b->pval) == 0;
+	default:
+		return false;
+	}
+}
+
+
+static struct hashtable *
+to_hashtable(struct obj *obj, const char *who)
+{
+	if (!obj || obj->type != THASH) panic("%s: argument is not a hash table\n", who);
+	return obj->pval;
+}
+
+
+static struct htslot *
+ht_find(struct hashtable *ht, struct obj *key, size_t hash)
+{
+	size_t mask = ht->cap - 1;
+	for (size_t i = hash & mask;; i = (i + 1) & mask) {
+		struct htslot *slot = &ht->slots[i];
+		if (slot->key == NULL) return NULL;
+		if (slot->key != &ht_tombstone && slot->hash == hash && key_equal(slot->key, key)) {
+			return slot;
+		}
+	}
+}
+
+
+static void
+ht_resize(struct hashtable *ht, size_t cap)
+{
+	struct htslot *old = ht->slots;
+	size_t oldcap = ht->cap;
+	ht->slots = scm_alloc(cap * sizeof(struct htslot), THASH);
+	memset(ht->slots, 0, cap * sizeof(struct htslot));
+	ht->cap = cap;
+	ht->used = ht->count;
+	size_t mask = cap - 1;
+	for (size_t i = 0; i < oldcap; i++) {
+		if (old[i].key == NULL || old[i].key == &ht_tombstone) continue;
+		size_t j = old[i].hash & mask;
+		while (ht->slots[j].key) j = (j + 1) & mask;
+		ht->slots[j] = old[i];
+	}
+	scm_free(old);
+}
+
+
+static void
+ht_set(struct hashtable *ht, struct obj *key, struct obj *value)
+{
+	if (!key) panic("hash table key must not be nil\n");
+	size_t hash = hash_obj(key);
+	struct htslot *slot = ht_find(ht, key, hash);
+	if (slot) {
+		slot->value = value;
+		return;
+	}
+	/// Keep the load factor including tombstones below 3/4
+	if ((ht->used + 1) * 4 > ht->cap * 3) {
+		size_t cap = HT_MINCAP;
+		while (cap < (ht->count + 1) * 2) cap *= 2;
+		ht_resize(ht, cap);
+	}
+	size_t mask = ht->cap - 1;
+	size_t i = hash & mask;
+	while (ht->slots[i].key && ht->slots[i].key != &ht_tombstone) i = (i + 1) & mask;
+	if (ht->slots[i].key == NULL) ht->used++;
+	ht->slots[i] = (struct htslot){ .key = key, .value = value, .hash = hash };
+	ht->count++;
+}
+
+
+/// Operations of the arithmetic and list builtins, which the compiler
+/// calls directly in place of calling the builtins
+struct obj *
+num_add(struct obj *a, struct obj *b)
+{
+	struct obj *res = gen_obj_int(0);
+	mpf_add(res->pval, a->pval, b->pval);
+	return res;
+}
+
+
+struct obj *
+num_sub(struct obj *a, struct obj *b)
+{
+	struct obj *res = gen_obj_int(0);
+	mpf_sub(res->pval, a->pval, b->pval);
+	return res;
+}
+
+
+struct obj *
+num_mul(struct obj *a, struct obj *b)
+{
+	struct obj *res = gen_obj_int(0);
+	if (a == NULL || b == NULL) {
+		fprintf(stderr, "arguments for '*' are NULL\n");
+	}
+	mpf_mul(res->pval, a->pval, b->pval);
+	return res;
+}
+
+
+struct obj *
+num_div(struct obj *a, struct obj *b)
+{
+	struct obj *res = gen_obj_float(0.0);
+	if (a == NULL || b == NULL) {
+		fprintf(stderr, "arguments for '/' are NULL\n");
+	}
+	mpf_div(res->pval, a->pval, b->pval);
+	return res;
+}
+
+
+int
+num_cmp(struct obj *a, struct obj *b)
+{
+	return mpf_cmp(a->pval, b->pval);
+}
+
+
+struct obj *
+list_car(struct obj *lst)
+{
+	return ((struct obj **)lst->pval)[0];
+}
+
+
+struct obj *
+list_cdr(struct obj *lst)
+{
+	struct obj *res = gen_obj_list();
+	struct obj **iarr = lst->pval;
+	struct obj **oarr = NULL;
+	size_t oarrlen = arrlenu(iarr) - 1;
+	oarr = arraddnptr(oarr, oarrlen);
+	for (size_t i = 0; i < oarrlen; i++) {
+		oarr[i] = iarr[i + 1];
+	}
+	res->pval = oarr;
+	return res;
+}
+
+
+bool
+list_null(struct obj *obj)
+{
+	return obj->type == TLIST && arrlenu((struct obj **)obj->pval) == 0;
+}
+
+
+/// Builtin functions called by the runtime/VM
+static void
+add(int nargs)
+{
+	(void)nargs;
+	struct obj *b = pop();
+	push(num_add(pop(), b));
+}
+
+
+static void
+sub(int nargs)
+{
+	(void)nargs;
+	struct obj *b = pop();
+	push(num_sub(pop(), b));
+}
+
+
+static void
+mul(int nargs)
+{
+	(void)nargs;
+	struct obj *b = pop();
+	push(num_mul(pop(), b));
+}
+
+
+static void
+div_float(int nargs)
+{
+	(void)nargs;
+	struct obj *b = pop();
+	push(num_div(pop(), b));
+}
+
+
+static void
+gt(int nargs)
+{
+	(void)nargs;
+	struct obj *b = pop();
+	push(gen_obj_bool(num_cmp(pop(), b) > 0));
+}
+
+
+static void
+lt(int nargs)
+{
+	(void)nargs;
+	struct obj *b = pop();
+	push(gen_obj_bool(num_cmp(pop(), b) < 0));
+}
+
+
+static void
+ge(int nargs)
+{
+	(void)nargs;
+	struct obj *b = pop();
+	push(gen_obj_bool(num_cmp(pop(), b) >= 0));
+}
+
+
+static void
+le(int nargs)
+{
+	(void)nargs;
+	struct obj *b = pop();
+	push(gen_obj_bool(num_cmp(pop(), b) <= 0));
+}
+
+
+static void
+eq(int nargs)
+{
+	(void)nargs;
+	struct obj *b = pop();
+	push(gen_obj_bool(num_cmp(pop(), b) == 0));
+}
+
+
+static void
+list(int nargs)
+{
+	struct obj *res = gen_obj_list();
+	struct obj **darr = NULL;
+	darr = arraddnptr(darr, nargs);
+	for (int i = nargs - 1; i >= 0; i--) {
+		darr[i] = pop();
+	}
+	res->pval = darr;
+	push(res);
+}
+
+
+static void
+car(int nargs)
+{
+	(void)nargs;
+	push(list_car(pop()));
+}
+
+
+static void
+cdr(int nargs)
+{
+	(void)nargs;
+	push(list_cdr(pop()));
+}
+
+
+static void
+cons(int nargs)
+{
+	(void)nargs;
+	struct obj *res = gen_obj_list();
+	struct obj **iarr = pop()->pval;
+	struct obj *iel = pop();
+	struct obj **oarr = NULL;
+	size_t oarrlen = arrlenu(iarr) + 1;
+	oarr = arraddnptr(oarr, oarrlen);
+	oarr[0] = iel;
+	for (size_t i = 1; i < oarrlen; i++) {
+		oarr[i] = iarr[i - 1];
+	}
+	res->pval = oarr;
+	push(res);
+}
+
+
+static void
+null_pred(int nargs)
+{
+	(void)nargs;
+	push(gen_obj_bool(list_null(pop())));
+}
+
+
+static void
+length(int nargs)
+{
+	(void)nargs;
+	struct obj **iarr = pop()->pval;
+	struct obj *res = gen_obj_int(arrlenu(iarr));
+	push(res);
+}
+
+
+static void
+append(int nargs)
+{
+	(void)nargs;
+	struct obj *res = gen_obj_list();
+	struct obj **iarr2 = pop()->pval;
+	struct obj **iarr1 = pop()->pval;
+	struct obj **oarr = NULL;
+	size_t oarrlen = arrlenu(iarr1) + arrlenu(iarr2);
+	oarr = arraddnptr(oarr, oarrlen);
+	for (size_t i = 0; i < arrlenu(iarr1); i++) {
+		oarr[i] = iarr1[i];
+	}
+	for (size_t i = 0; i < arrlenu(iarr2); i++) {
+		oarr[i + arrlenu(iarr1)] = iarr2[i];
+	}
+	res->pval = oarr;
+	push(res);
+}
+
+
+/// Sorting: a stable merge sort of the elements of a list, ordered by a
+/// Scheme procedure. When it is the builtin < or > and all elements are
+/// numbers, they are compared directly instead of calling it: by their
+/// values truncated to doubles, which keep their order, and only if
+/// those are equal by their exact values.
+struct sort_key {
+	double d;
+	struct obj *obj;
+};
+struct sort_order {
+	struct obj *proc;
+	/// 1 for <, -1 for >, 0 to call proc
+	int sign;
+};
+
+
+static inline bool
+sort_less(struct sort_order *ord, struct sort_key *a, struct sort_key *b)
+{
+	if (ord->sign) {
+		if (a->d != b->d) return ord->sign > 0 ? a->d < b->d : a->d > b->d;
+		return ord->sign * mpf_cmp(a->obj->pval, b->obj->pval) < 0;
+	}
+	push(a->obj);
+	push(b->obj);
+	call_obj(ord->proc, 2);
+	return is_true(pop());
+}
+
+
+static void
+merge_sort(struct sort_key *arr, size_t n, struct sort_order *ord)
+{
+	/// Runs of SORT_RUN elements are insertion sorted, then merged pairwise
+	enum { SORT_RUN = 16 };
+	for (size_t lo = 0; lo < n; lo += SORT_RUN) {
+		size_t hi = lo + SORT_RUN < n ? lo + SORT_RUN : n;
+		for (size_t i = lo + 1; i < hi; i++) {
+			struct sort_key x = arr[i];
+			size_t j = i;
+			for (; j > lo && sort_less(ord, &x, &arr[j - 1]); j--) arr[j] = arr[j - 1];
+			arr[j] = x;
+		}
+	}
+	if (n <= SORT_RUN) return;
+	struct sort_key *tmp = malloc(n * sizeof(struct sort_key));
+	for (size_t w = SORT_RUN; w < n; w *= 2) {
+		for (size_t lo = 0; lo + w < n; lo += 2 * w) {
+			size_t mid = lo + w, hi = lo + 2 * w < n ? lo + 2 * w : n;
+			/// Already in order
+			if (!sort_less(ord, &arr[mid], &arr[mid - 1])) continue;
+			size_t i = lo, j = mid, k = lo;
+			while (i < mid && j < hi) tmp[k++] = sort_less(ord, &arr[j], &arr[i]) ? arr[j++] : arr[i++];
+			while (i < mid) tmp[k++] = arr[i++];
+			while (j < hi) tmp[k++] = arr[j++];
+			memcpy(arr + lo, tmp + lo, (hi - lo) * sizeof(struct sort_key));
+		}
+	}
+	free(tmp);
+}
+
+
+/// Sorts the elements of lst in place
+static void
+sort_list(struct obj *lst, struct obj *proc, const char *who)
+{
+	if (!proc || proc->type != TFUNC) panic("%s: argument is not a procedure\n", who);
+	if (!lst || lst->type != TLIST) panic("%s: argument is not a list\n", who);
+	struct obj **arr = lst->pval;
+	size_t n = arrlenu(arr);
+	struct sort_order ord = { .proc = proc, .sign = 0 };
+	if (proc->pval == (void *)lt || proc->pval == (void *)gt) ord.sign = proc->pval == (void *)lt ? 1 : -1;
+	struct sort_key *keys = malloc((n + 1) * sizeof(struct sort_key));
+	for (size_t i = 0; i < n; i++) {
+		keys[i].obj = arr[i];
+		if (!ord.sign) continue;
+		if (!arr[i] || arr[i]->type != TNUM) {
+			ord.sign = 0;
+			continue;
+		}
+		keys[i].d = mpf_get_d(arr[i]->pval);
+	}
+	merge_sort(keys, n, &ord);
+	for (size_t i = 0; i < n; i++) arr[i] = keys[i].obj;
+	free(keys);
+}
+
+
+static struct obj *
+copy_list(struct obj *lst, const char *who)
+{
+	if (!lst || lst->type != TLIST) panic("%s: argument is not a list\n", who);
+	struct obj *res = gen_obj_list();
+	struct obj **iarr = lst->pval;
+	struct obj **oarr = NULL;
+	if (arrlenu(iarr) > 0) memcpy(arraddnptr(oarr, arrlenu(iarr)), iarr, arrlenu(iarr) * sizeof(struct obj *));
+	res->pval = oarr;
+	return res;
+}
+
+
+static void
+sort(int nargs)
+{
+	/// (sort list less?)
+	(void)nargs;
+	struct obj *proc = pop();
+	struct obj *res = copy_list(pop(), "sort");
+	sort_list(res, proc, "sort");
+	push(res);
+}
+
+
+static void
+list_sort(int nargs)
+{
+	/// (list-sort less? list)
+	(void)nargs;
+	struct obj *res = copy_list(pop(), "list-sort");
+	sort_list(res, pop(), "list-sort");
+	push(res);
+}
+
+
+static void
+sort_bang(int nargs)
+{
+	/// (sort! list less?)
+	(void)nargs;
+	struct obj *proc = pop();
+	struct obj *lst = pop();
+	sort_list(lst, proc, "sort!");
+	push(lst);
+}
+
+
+/// Higher order list procedures. They loop in C over the arrays of the
+/// lists, build the result with one allocation and call the procedure
+/// without the checks of call_obj, done once up front.
+static struct obj *
+check_proc(struct obj *proc, const char *who)
+{
+	if (!proc || proc->type != TFUNC) panic("%s: argument is not a procedure\n", who);
+	return proc;
+}
+
+
+static inline struct obj *
+apply_proc(struct obj *proc, int nargs)
+{
+	if (tracing) {
+		call_obj(proc, nargs);
+	} else {
+		cur_closure = proc;
+		((func *)proc->pval)(nargs);
+	}
+	return pop();
+}
+
+
+/// Pops the nlists lists on top of the stack into lists, returns the
+/// length of the shortest
+static size_t
+pop_lists(struct obj ***lists, int nlists, const char *who)
+{
+	size_t n = SIZE_MAX;
+	for (int i = nlists - 1; i >= 0; i--) {
+		struct obj *lst = pop();
+		if (!lst || lst->type != TLIST) panic("%s: argument is not a list\n", who);
+		lists[i] = lst->pval;
+		if (arrlenu(lists[i]) < n) n = arrlenu(lists[i]);
+	}
+	return nlists > 0 ? n : 0;
+}
+
+
+static void
+map(int nargs)
+{
+	/// (map proc list ...)
+	struct obj **lists[nargs + 1];
+	size_t n = pop_lists(lists, nargs - 1, "map");
+	struct obj *proc = check_proc(pop(), "map");
+	struct obj **oarr = NULL;
+	arrsetcap(oarr, n);
+	for (size_t i = 0; i < n; i++) {
+		for (int j = 0; j < nargs - 1; j++) push(lists[j][i]);
+		arrput(oarr, apply_proc(proc, nargs - 1));
+	}
+	struct obj *res = gen_obj_list();
+	res->pval = oarr;
+	push(res);
+}
+
+
+static void
+for_each(int nargs)
+{
+	/// (for-each proc list ...)
+	struct obj **lists[nargs + 1];
+	size_t n = pop_lists(lists, nargs - 1, "for-each");
+	struct obj *proc = check_proc(pop(), "for-each");
+	for (size_t i = 0; i < n; i++) {
+		for (int j = 0; j < nargs - 1; j++) push(lists[j][i]);
+		apply_proc(proc, nargs - 1);
+	}
+	push(NULL);
+}
+
+
+static void
+filter(int nargs)
+{
+	/// (filter pred list)
+	(void)nargs;
+	struct obj **iarr;
+	size_t n = pop_lists(&iarr, 1, "filter");
+	struct obj *pred = check_proc(pop(), "filter");
+	struct obj **oarr = NULL;
+	arrsetcap(oarr, n);
+	for (size_t i = 0; i < n; i++) {
+		push(iarr[i]);
+		if (is_true(apply_proc(pred, 1))) arrput(oarr, iarr[i]);
+	}
+	struct obj *res = gen_obj_list();
+	res->pval = oarr;
+	push(res);
+}
+
+
+static void
+fold_left(int nargs)
+{
+	/// (fold-left proc init list ...) calls (proc acc x ...) left to right
+	struct obj **lists[nargs + 1];
+	size_t n = pop_lists(lists, nargs - 2, "fold-left");
+	struct obj *acc = pop();
+	struct obj *proc = check_proc(pop(), "fold-left");
+	for (size_t i = 0; i < n; i++) {
+		push(acc);
+		for (int j = 0; j < nargs - 2; j++) push(lists[j][i]);
+		acc = apply_proc(proc, nargs - 1);
+	}
+	push(acc);
+}
+
+
+static void
+fold_right(int nargs)
+{
+	/// (fold-right proc init list ...) calls (proc x ... acc) right to left
+	struct obj **lists[nargs + 1];
+	size_t n = pop_lists(lists, nargs - 2, "fold-right");
+	struct obj *acc = pop();
+	struct obj *proc = check_proc(pop(), "fold-right");
+	for (size_t i = n; i-- > 0;) {
+		for (int j = 0; j < nargs - 2; j++) push(lists[j][i]);
+		push(acc);
+		acc = apply_proc(proc, nargs - 1);
+	}
+	push(acc);
+}
+
+
+static void
+reduce(int nargs)
+{
+	/// (reduce proc init list) calls (proc x acc) left to right, starting
+	/// with the first element, or returns init if list is empty
+	(void)nargs;
+	struct obj **iarr;
+	size_t n = pop_lists(&iarr, 1, "reduce");
+	struct obj *acc = pop();
+	struct obj *proc = check_proc(pop(), "reduce");
+	if (n > 0) acc = iarr[0];
+	for (size_t i = 1; i < n; i++) {
+		push(iarr[i]);
+		push(acc);
+		acc = apply_proc(proc, 2);
+	}
+	push(acc);
+}
+
+
+static void
+make_hash_table(int nargs)
+{
+	(void)nargs;
+	push(gen_obj_hashtable());
+}
+
+
+static void
+hash_table_ref(int nargs)
+{
+	struct obj *dflt = nargs > 2 ? pop() : NULL;
+	struct obj *key = pop();
+	struct hashtable *ht = to_hashtable(pop(), "hash-table-ref");
+	struct htslot *slot = key ? ht_find(ht, key, hash_obj(key)) : NULL;
+	if (slot) push(slot->value);
+	else if (nargs > 2) push(dflt);
+	else panic("hash-table-ref: key not found\n");
+}
+
+
+static void
+hash_table_set(int nargs)
+{
+	(void)nargs;
+	struct obj *value = pop();
+	struct obj *key = pop();
+	ht_set(to_hashtable(pop(), "hash-table-set!"), key, value);
+	push(NULL);
+}
+
+
+static void
+hash_table_delete(int nargs)
+{
+	(void)nargs;
+	struct obj *key = pop();
+	struct hashtable *ht = to_hashtable(pop(), "hash-table-delete!");
+	struct htslot *slot = key ? ht_find(ht, key, hash_obj(key)) : NULL;
+	if (slot) {
+		slot->key = &ht_tombstone;
+		slot->value = NULL;
+		ht->count--;
+	}
+	push(NULL);
+}
+
+
+static void
+hash_table_contains(int nargs)
+{
+	(void)nargs;
+	struct obj *key = pop();
+	struct hashtable *ht = to_hashtable(pop(), "hash-table-contains?");
+	push(gen_obj_bool(key && ht_find(ht, key, hash_obj(key))));
+}
+
+
+static void
+hash_table_count(int nargs)
+{
+	(void)nargs;
+	push(gen_obj_int(to_hashtable(pop(), "hash-table-count")->count));
+}
+
+
+/// Collect the entries of a hash table into a list.
+/// what: 0 keys, 1 values, 2 (key value) lists
+static void
+ht_collect(struct hashtable *ht, int what)
+{
+	struct obj *res = gen_obj_list();
+	struct obj **oarr = NULL;
+	arrsetcap(oarr, ht->count);
+	for (size_t i = 0; i < ht->cap; i++) {
+		struct htslot *slot = &ht->slots[i];
+		if (slot->key == NULL || slot->key == &ht_tombstone) continue;
+		if (what == 0) {
+			arrput(oarr, slot->key);
+		} else if (what == 1) {
+			arrput(oarr, slot->value);
+		} else {
+			struct obj *entry = gen_obj_list();
+			sexp_append_obj_inplace(entry, slot->key);
+			sexp_append_obj_inplace(entry, slot->value);
+			arrput(oarr, entry);
+		}
+	}
+	res->pval = oarr;
+	push(res);
+}
+
+
+static void
+hash_table_keys(int nargs)
+{
+	(void)nargs;
+	ht_collect(to_hashtable(pop(), "hash-table-keys"), 0);
+}
+
+
+static void
+hash_table_values(int nargs)
+{
+	(void)nargs;
+	ht_collect(to_hashtable(pop(), "hash-table-values"), 1);
+}
+
+
+static void
+hash_table_to_alist(int nargs)
+{
+	(void)nargs;
+	ht_collect(to_hashtable(pop(), "hash-table->alist"), 2);
+}
+
+
+static void
+hash_table_walk(int nargs)
+{
+	(void)nargs;
+	struct obj *proc = pop();
+	struct hashtable *ht = to_hashtable(pop(), "hash-table-walk");
+	/// Walk a snapshot, so proc may modify the table
+	struct htslot *entries = NULL;
+	for (size_t i = 0; i < ht->cap; i++) {
+		if (ht->slots[i].key == NULL || ht->slots[i].key == &ht_tombstone) continue;
+		arrput(entries, ht->slots[i]);
+	}
+	for (size_t i = 0; i < arrlenu(entries); i++) {
+		push(entries[i].key);
+		push(entries[i].value);
+		call_obj(proc, 2);
+		pop();
+	}
+	arrfree(entries);
+	push(NULL);
+}
+
+
+static void
+string_length(int nargs)
+{
+	(void)nargs;
+	push(gen_obj_int(to_string(pop(), "string-length")->len));
+}
+
+
+static void
+string_append(int nargs)
+{
+	struct string **args = NULL;
+	size_t addlen = 0;
+	arraddnptr(args, nargs);
+	for (int i = nargs - 1; i >= 0; i--) {
+		args[i] = to_string(pop(), "string-append");
+		if (i > 0) addlen += args[i]->len;
+	}
+	if (nargs == 0) {
+		arrfree(args);
+		push(gen_obj_str("", 0));
+		return;
+	}
+	struct string *first = args[0];
+	struct strbuf *buf = first->buf;
+	size_t off = first->off;
+	size_t end = off + first->len;
+	/// Claim the space behind first if first ends at the end of its buffer,
+	/// otherwise copy first into a fresh buffer with room to grow
+	if (buf->cap == 0 || end + addlen > buf->cap
+			|| !__atomic_compare_exchange_n(&buf->len, &end, end + addlen, false,
+				__ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+		struct strbuf *nbuf = scm_alloc(sizeof(struct strbuf), TSTRING);
+		nbuf->cap = 2 * (first->len + addlen) + 16;
+		nbuf->data = scm_alloc(nbuf->cap, TSTRING);
+		memcpy(nbuf->data, str_data(first), first->len);
+		nbuf->len = first->len + addlen;
+		buf = nbuf;
+		off = 0;
+		end = first->len;
+	}
+	for (int i = 1; i < nargs; i++) {
+		memcpy(buf->data + end, str_data(args[i]), args[i]->len);
+		end += args[i]->len;
+	}
+	push(gen_obj_strview(buf, off, end - off));
+	arrfree(args);
+}
+
+
+static void
+substring(int nargs)
+{
+	struct obj *endo = nargs > 2 ? pop() : NULL;
+	long int beg = mpf_get_si(pop()->pval);
+	struct string *str = to_string(pop(), "substring");
+	long int end = endo ? mpf_get_si(endo->pval) : (long int)str->len;
+	if (beg < 0 || end < beg || (size_t)end > str->len) {
+		panic("substring: range [%ld, %ld) out of bounds\n", beg, end);
+	}
+	push(gen_obj_strview(str->buf, str->off + beg, end - beg));
+}
+
+
+static void
+string_eq(int nargs)
+{
+	(void)nargs;
+	struct string *b = to_string(pop(), "string=?");
+	struct string *a = to_string(pop(), "string=?");
+	push(gen_obj_bool(str_cmp(a, b) == 0));
+}
+
+
+static void
+string_lt(int nargs)
+{
+	(void)nargs;
+	struct string *b = to_string(pop(), "string<?");
+	struct string *a = to_string(pop(), "string<?");
+	push(gen_obj_bool(str_cmp(a, b) < 0));
+}
+
+
+static void
+string_to_number(int nargs)
+{
+	(void)nargs;
+	struct string *str = to_string(pop(), "string->number");
+	char *s = strndup(str_data(str), str->len);
+	struct obj *res = gen_obj_int(0);
+	if (str->len == 0 || mpf_set_str(res->pval, s, 10) != 0) res = gen_obj_bool(false);
+	free(s);
+	push(res);
+}
+
+
+static void
+number_to_string(int nargs)
+{
+	(void)nargs;
+	char *s = obj_tostr(pop());
+	push(gen_obj_str(s, strlen(s)));
+}
+
+
+static void
+string_to_symbol(int nargs)
+{
+	(void)nargs;
+	struct string *str = to_string(pop(), "string->symbol");
+	char *s = strndup(str_data(str), str->len);
+	push(gen_obj_symb(s));
+	free(s);
+}
+
+
+static void
+symbol_to_string(int nargs)
+{
+	(void)nargs;
+	struct obj *o = pop();
+	if (!o || o->type != TSYMB) panic("symbol->string: argument is not a symbol\n");
+	push(gen_obj_str(o->pval, strlen(o->pval)));
+}
+
+
+/// Futures and the work stealing thread pool
+
+static struct envt *
+env_snapshot(void)
+{
+	struct envt *snap = malloc(sizeof(struct envt));
+	snap->e = NULL;
+	snap->version = new_version();
+	for (int j = 0; j < shlen(env->e); j++) {
+		shput(snap->e, env->e[j].key, env->e[j].value);
+	}
+	return snap;
+}
+
+
+static struct obj *
+future_value(struct future *f)
+{
+	if (f->thunk) {
+		call_obj(f->thunk, 0);
+		return pop();
+	}
+	struct obj *value = gen_obj_list();
+	struct obj **oarr = NULL;
+	arrsetcap(oarr, f->nitems);
+	for (size_t i = 0; i < f->nitems; i++) {
+		push(f->items[i]);
+		call_obj(f->proc, 1);
+		arrput(oarr, pop());
+	}
+	value->pval = oarr;
+	return value;
+}
+
+
+static void
+run_future(struct future *f)
+{
+	int state = FPENDING;
+	if (!__atomic_compare_exchange_n(&f->state, &state, FRUNNING, false,
+			__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		return;
+	}
+	struct envt *saved_env = env;
+	env = f->env;
+	global_version = env->version;
+	struct obj *value = NULL;
+	if (!f->caught) {
+		value = future_value(f);
+	} else {
+		struct handler h = { .gen = gen_cur, .sp = sp, .error = NULL }, *saved_handler = on_error;
+		on_error = &h;
+		if (setjmp(h.buf) == 0) {
+			value = future_value(f);
+		} else {
+			panic_recover(&h);
+			f->error = h.error;
+		}
+		on_error = saved_handler;
+	}
+	shfree(env->e);
+	free(env);
+	env = saved_env;
+	global_version = env->version;
+	pthread_mutex_lock(&f->lock);
+	f->value = value;
+	__atomic_store_n(&f->state, FDONE, __ATOMIC_RELEASE);
+	pthread_cond_broadcast(&f->done);
+	pthread_mutex_unlock(&f->lock);
+}
+
+
+static struct future *
+pool_take(void)
+{
+	/// Pop from the own deque first, then steal from the others
+	struct future *f = NULL;
+	for (int i = 0; i < nthreads && !f; i++) {
+		struct deque *dq = &deques[(thread_id + i) % nthreads];
+		pthread_mutex_lock(&dq->lock);
+		if (arrlenu(dq->tasks) > dq->head) {
+			f = i == 0 ? arrpop(dq->tasks) : dq->tasks[dq->head++];
+			if (arrlenu(dq->tasks) == dq->head) {
+				arrsetlen(dq->tasks, 0);
+				dq->head = 0;
+			}
+		}
+		pthread_mutex_unlock(&dq->lock);
+	}
+	if (f) {
+		pthread_mutex_lock(&pool_lock);
+		pool_pending--;
+		pthread_mutex_unlock(&pool_lock);
+	}
+	return f;
+}
+
+
+static void *
+pool_worker(void *arg)
+{
+	thread_id = (int)(intptr_t)arg;
+	alloc_busy = true;
+	for (;;) {
+		struct future *f = pool_take();
+		if (f) {
+			run_future(f);
+			continue;
+		}
+		pthread_mutex_lock(&pool_lock);
+		while (pool_pending == 0) pthread_cond_wait(&pool_cv, &pool_lock);
+		pthread_mutex_unlock(&pool_lock);
+	}
+	return NULL;
+}
+
+
+static void
+pool_start(void)
+{
+	/// Started on the first future, by the main thread, with one worker
+	/// per core besides the main thread, or SCHEMEL_THREADS threads in total
+	if (nthreads) return;
+	char *nstr = getenv("SCHEMEL_THREADS");
+	int n = nstr ? atoi(nstr) : (int)sysconf(_SC_NPROCESSORS_ONLN);
+	if (n < 1) n = 1;
+	if (n > MAX_THREADS) n = MAX_THREADS;
+	for (int i = 0; i < n; i++) {
+		deques[i].tasks = NULL;
+		deques[i].head = 0;
+		pthread_mutex_init(&deques[i].lock, NULL);
+	}
+	nthreads = n;
+	for (int i = 1; i < n; i++) {
+		pthread_t th;
+		if (pthread_create(&th, NULL, pool_worker, (void *)(intptr_t)i) != 0) {
+			panic("could not start worker thread\n");
+		}
+		pthread_detach(th);
+	}
+}
+
+
+static struct obj *
+spawn_future(struct future *f)
+{
+	f->env = env_snapshot();
+	f->value = NULL;
+	f->caught = on_error != NULL;
+	f->error = NULL;
+	f->state = FPENDING;
+	pthread_mutex_init(&f->lock, NULL);
+	pthread_cond_init(&f->done, NULL);
+	pool_start();
+	struct deque *dq = &deques[thread_id];
+	pthread_mutex_lock(&dq->lock);
+	arrput(dq->tasks, f);
+	pthread_mutex_unlock(&dq->lock);
+	pthread_mutex_lock(&pool_lock);
+	pool_pending++;
+	pthread_cond_signal(&pool_cv);
+	pthread_mutex_unlock(&pool_lock);
+	struct obj *res = scm_alloc(sizeof(struct obj), TFUTURE);
+	res->type = TFUTURE;
+	res->pval = f;
+	res->vars = NULL;
+	return res;
+}
+
+
+static struct obj *
+touch_future(struct obj *obj)
+{
+	/// Run the future here if no worker took it yet, otherwise wait for it
+	if (!obj || obj->type != TFUTURE) return obj;
+	struct future *f = obj->pval;
+	if (__atomic_load_n(&f->state, __ATOMIC_ACQUIRE) != FDONE) {
+		run_future(f);
+		pthread_mutex_lock(&f->lock);
+		while (f->state != FDONE) pthread_cond_wait(&f->done, &f->lock);
+		pthread_mutex_unlock(&f->lock);
+	}
+	if (f->error) panic("%s\n", f->error);
+	return f->value;
+}
+
+
+static void
+make_future(int nargs)
+{
+	(void)nargs;
+	struct obj *thunk = pop();
+	if (!thunk || thunk->type != TFUNC) panic("future: argument is not a procedure\n");
+	struct future *f = scm_alloc(sizeof(struct future), TFUTURE);
+	*f = (struct future){ .thunk = thunk };
+	push(spawn_future(f));
+}
+
+
+static void
+touch(int nargs)
+{
+	(void)nargs;
+	push(touch_future(pop()));
+}
+
+
+static void
+pmap(int nargs)
+{
+	(void)nargs;
+	struct obj *lst = pop();
+	struct obj *proc = pop();
+	if (!proc || proc->type != TFUNC) panic("pmap: argument is not a procedure\n");
+	if (!lst || lst->type != TLIST) panic("pmap: argument is not a list\n");
+	struct obj **iarr = lst->pval;
+	size_t len = arrlenu(iarr);
+	pool_start();
+	/// A few chunks per thread, so stealing can balance uneven work
+	size_t nchunks = nthreads * 4;
+	if (nchunks > len) nchunks = len;
+	struct obj **chunks = NULL;
+	for (size_t c = 0; c < nchunks; c++) {
+		size_t beg = len * c / nchunks, end = len * (c + 1) / nchunks;
+		struct future *f = scm_alloc(sizeof(struct future), TFUTURE);
+		*f = (struct future){ .proc = proc, .items = iarr + beg, .nitems = end - beg };
+		arrput(chunks, spawn_future(f));
+	}
+	struct obj *res = gen_obj_list();
+	struct obj **oarr = NULL;
+	arrsetcap(oarr, len);
+	for (size_t c = 0; c < nchunks; c++) {
+		struct obj **carr = touch_future(chunks[c])->pval;
+		memcpy(arraddnptr(oarr, arrlenu(carr)), carr, arrlenu(carr) * sizeof(struct obj *));
+	}
+	arrfree(chunks);
+	res->pval = oarr;
+	push(res);
+}
+
+
+/// Generators, coroutines on their own stacks
+
+#if defined(__x86_64__)
+/// Save the callee saved registers on the current stack and the stack
+/// pointer in *from, then continue on the stack saved in *to
+void co_switch(coctx *from, coctx *to);
+__asm__(
+	".text\n"
+	".globl co_switch\n"
+	".hidden co_switch\n"
+	".type co_switch, @function\n"
+	"co_switch:\n"
+	"	pushq %rbp\n"
+	"	pushq %rbx\n"
+	"	pushq %r12\n"
+	"	pushq %r13\n"
+	"	pushq %r14\n"
+	"	pushq %r15\n"
+	"	movq %rsp, (%rdi)\n"
+	"	movq (%rsi), %rsp\n"
+	"	popq %r15\n"
+	"	popq %r14\n"
+	"	popq %r13\n"
+	"	popq %r12\n"
+	"	popq %rbx\n"
+	"	popq %rbp\n"
+	"	ret\n"
+	".size co_switch, .-co_switch\n");
+
+
+static void
+co_make(coctx *ctx, char *cstack, size_t size, void (*entry)(void))
+{
+	/// The first switch pops zeroed registers and returns into entry,
+	/// aligned as if entry was called
+	void **top = (void **)(((uintptr_t)cstack + size) & ~(uintptr_t)15);
+	*--top = NULL;
+	*--top = (void *)entry;
+	for (int i = 0; i < 6; i++) *--top = NULL;
+	*ctx = top;
+}
+#else
+static void
+co_switch(coctx *from, coctx *to)
+{
+	swapcontext(from, to);
+}
+
+
+static void
+co_make(coctx *ctx, char *cstack, size_t size, void (*entry)(void))
+{
+	getcontext(ctx);
+	ctx->uc_stack.ss_sp = cstack;
+	ctx->uc_stack.ss_size = size;
+	ctx->uc_link = NULL;
+	makecontext(ctx, entry, 0);
+}
+#endif
+
+
+/// Move the generator's part of the VM stacks out of them when it yields
+static void
+gen_save(struct generator *g)
+{
+	arrsetlen(g->vals, 0);
+	for (int i = g->sp_base + 1; i <= sp; i++) arrput(g->vals, stack[i]);
+	sp = g->sp_base;
+	if (tracing && prof_enabled) {
+		/// The time run since resumed is the resumer's child time,
+		/// suspended frames are not active
+		g->suspended = prof_now();
+		g->charged += g->suspended - g->resumed;
+		if (g->prof_base > 0) prof_stack[g->prof_base - 1].child += g->suspended - g->resumed;
+		arrsetlen(g->frames, 0);
+		for (ptrdiff_t i = g->prof_base; i < arrlen(prof_stack); i++) {
+			prof_tab[prof_stack[i].rec].value.active--;
+			arrput(g->frames, prof_stack[i]);
+		}
+		arrsetlen(prof_stack, g->prof_base);
+	}
+}
+
+
+/// Put the generator's part of the VM stacks back on top when it resumes
+static void
+gen_restore(struct generator *g)
+{
+	g->sp_base = sp;
+	for (ptrdiff_t i = 0; i < arrlen(g->vals); i++) push(g->vals[i]);
+	if (tracing && prof_enabled) {
+		/// Suspended time doesn't count for the generator's frames
+		g->resumed = prof_now();
+		g->prof_base = arrlen(prof_stack);
+		for (ptrdiff_t i = 0; i < arrlen(g->frames); i++) {
+			struct prof_frame fr = g->frames[i];
+			fr.start += g->resumed - g->suspended;
+			prof_tab[fr.rec].value.active++;
+			arrput(prof_stack, fr);
+		}
+	}
+}
+
+
+static void
+gen_entry(void)
+{
+	struct generator *g = gen_cur;
+	call_obj(g->thunk, 0);
+	pop();
+	g->value = &eof_obj;
+	g->state = GDONE;
+	/// Never resumed again
+	co_switch(&g->ctx, &g->caller);
+}
+
+
+static struct obj *
+gen_resume(struct generator *g)
+{
+	if (g->state == GDONE) return &eof_obj;
+	if (g->state == GRUNNING) panic("generator-next: generator is already running\n");
+	if (g->state == GNEW) {
+		g->cstack = mmap(NULL, CO_STACK, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if (g->cstack == MAP_FAILED) panic("generator-next: could not map a stack\n");
+		/// Guard page against overflow
+		mprotect(g->cstack, sysconf(_SC_PAGESIZE), PROT_NONE);
+		co_make(&g->ctx, g->cstack, CO_STACK, gen_entry);
+	}
+	gen_restore(g);
+	func *caller_fn = cur_fn;
+	g->resumer = gen_cur;
+	g->state = GRUNNING;
+	gen_cur = g;
+	co_switch(&g->caller, &g->ctx);
+	gen_cur = g->resumer;
+	cur_fn = caller_fn;
+	if (g->state == GDONE) {
+		/// The generator's outermost frame was charged to this resumer
+		/// in full, without the slices charged to earlier ones
+		if (tracing && prof_enabled && g->prof_base > 0) {
+			prof_stack[g->prof_base - 1].child -= g->charged;
+		}
+		munmap(g->cstack, CO_STACK);
+		g->cstack = NULL;
+		arrfree(g->vals);
+		arrfree(g->frames);
+	}
+	return g->value;
+}
+
+
+static void
+make_generator(int nargs)
+{
+	(void)nargs;
+	struct obj *thunk = pop();
+	if (!thunk || thunk->type != TFUNC) panic("make-generator: argument is not a procedure\n");
+	struct generator *g = scm_alloc(sizeof(struct generator), TGENERATOR);
+	*g = (struct generator){ .thunk = thunk, .state = GNEW };
+	struct obj *res = scm_alloc(sizeof(struct obj), TGENERATOR);
+	res->type = TGENERATOR;
+	res->pval = g;
+	res->vars = NULL;
+	push(res);
+}
+
+
+static void
+generator_next(int nargs)
+{
+	(void)nargs;
+	struct obj *obj = pop();
+	if (!obj || obj->type != TGENERATOR) panic("generator-next: argument is not a generator\n");
+	push(gen_resume(obj->pval));
+}
+
+
+static void
+yield(int nargs)
+{
+	(void)nargs;
+	struct generator *g = gen_cur;
+	if (!g) panic("yield: not inside a generator\n");
+	g->value = pop();
+	g->state = GSUSPENDED;
+	func *fn = cur_fn;
+	gen_save(g);
+	co_switch(&g->ctx, &g->caller);
+	cur_fn = fn;
+	push(NULL);
+}
+
+
+static void
+eof_object(int nargs)
+{
+	(void)nargs;
+	push(&eof_obj);
+}
+
+
+static void
+eof_object_pred(int nargs)
+{
+	(void)nargs;
+	push(gen_obj_bool(pop() == &eof_obj));
+}
+
+
+/// Input ports
+
+static struct in_port *
+to_in_port(struct obj *obj, const char *who)
+{
+	if (!obj) {
+		/// The current input port, standard input
+		if (!stdin_port.buf) {
+			stdin_port.cap = PORT_BUFLEN + 1;
+			stdin_port.buf = malloc(stdin_port.cap);
+			stdin_port.buf[0] = 0;
+		}
+		return &stdin_port;
+	}
+	if (obj->type != TPORT) panic("%s: argument is not an input port\n", who);
+	struct in_port *p = obj->pval;
+	if (p->fd < 0) panic("%s: port is closed\n", who);
+	return p;
+}
+
+
+/// Reads the next block after the unconsumed bytes, which are moved to
+/// the front of the buffer. The buffer grows only if they fill it.
+/// Returns false at the end of the file.
+static bool
+in_port_fill(struct in_port *p)
+{
+	if (p->eof) return false;
+	p->len -= p->pos;
+	memmove(p->buf, p->buf + p->pos, p->len);
+	p->pos = 0;
+	if (p->cap - p->len - 1 < PORT_BUFLEN / 2) {
+		p->cap *= 2;
+		p->buf = realloc(p->buf, p->cap);
+	}
+	ssize_t n = read(p->fd, p->buf + p->len, p->cap - p->len - 1);
+	if (n < 0) panic("could not read from port\n");
+	if (n == 0) p->eof = true;
+	p->len += n;
+	p->buf[p->len] = 0;
+	return n > 0;
+}
+
+
+/// End of the datum starting at s, or NULL if it continues past end
+static char *
+datum_end(char *s, char *end, bool eof)
+{
+	int depth = 0;
+	do {
+		while (s < end && isspace(*s)) s++;
+		if (s == end) return NULL;
+		if (*s == '(') {
+			depth++;
+			s++;
+		} else if (*s == ')') {
+			if (--depth < 0) panic("read: unexpected ')'\n");
+			s++;
+		} else if (*s == '"') {
+			for (s++; s < end && *s != '"'; s++) {
+				if (*s == '\\') s++;
+			}
+			if (s >= end) return NULL;
+			s++;
+		} else {
+			while (s < end && !isspace(*s) && *s != '(' && *s != ')' && *s != '"') s++;
+			if (s == end && !eof) return NULL;
+		}
+	} while (depth > 0);
+	return s;
+}
+
+
+static void
+open_input_file(int nargs)
+{
+	(void)nargs;
+	struct obj *name = pop();
+	if (!name || name->type != TSTRING) panic("open-input-file: argument is not a string\n");
+	struct string *str = name->pval;
+	char *path = strndup(str_data(str), str->len);
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) panic("open-input-file: could not open '%s'\n", path);
+	free(path);
+	struct in_port *p = scm_alloc(sizeof(struct in_port), TPORT);
+	*p = (struct in_port){ .fd = fd, .cap = PORT_BUFLEN + 1 };
+	p->buf = malloc(p->cap);
+	p->buf[0] = 0;
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	struct obj *res = scm_alloc(sizeof(struct obj), TPORT);
+	res->type = TPORT;
+	res->pval = p;
+	res->vars = NULL;
+	push(res);
+}
+
+
+static void
+close_input_port(int nargs)
+{
+	(void)nargs;
+	struct in_port *p = to_in_port(pop(), "close-input-port");
+	if (p != &stdin_port) {
+		close(p->fd);
+		free(p->buf);
+		p->fd = -1;
+	}
+	push(NULL);
+}
+
+
+static void
+read_line(int nargs)
+{
+	struct in_port *p = to_in_port(nargs > 0 ? pop() : NULL, "read-line");
+	/// Bytes already searched for the newline
+	size_t scanned = 0;
+	char *nl;
+	while (!(nl = memchr(p->buf + p->pos + scanned, '\n', p->len - p->pos - scanned))) {
+		scanned = p->len - p->pos;
+		if (!in_port_fill(p)) break;
+	}
+	size_t len = nl ? (size_t)(nl - p->buf) - p->pos : p->len - p->pos;
+	if (!nl && len == 0) {
+		push(&eof_obj);
+		return;
+	}
+	char *s = scm_alloc(len + 1, TSTRING);
+	memcpy(s, p->buf + p->pos, len);
+	p->pos += len + (nl ? 1 : 0);
+	push(gen_obj_str(s, len));
+}
+
+
+/// Characters are strings of one byte
+static void
+peek_or_read_char(int nargs, bool advance, const char *who)
+{
+	struct in_port *p = to_in_port(nargs > 0 ? pop() : NULL, who);
+	if (p->pos == p->len && !in_port_fill(p)) {
+		push(&eof_obj);
+		return;
+	}
+	char *s = scm_alloc(1, TSTRING);
+	*s = p->buf[p->pos];
+	if (advance) p->pos++;
+	push(gen_obj_str(s, 1));
+}
+
+
+static void
+read_char(int nargs)
+{
+	peek_or_read_char(nargs, true, "read-char");
+}
+
+
+static void
+peek_char(int nargs)
+{
+	peek_or_read_char(nargs, false, "peek-char");
+}
+
+
+static void
+read_datum(int nargs)
+{
+	/// (read port) parses the next datum with the lexer of the compiler,
+	/// once the buffer holds all of it
+	struct in_port *p = to_in_port(nargs > 0 ? pop() : NULL, "read");
+	char *end;
+	while (!(end = datum_end(p->buf + p->pos, p->buf + p->len, p->eof))) {
+		if (!p->eof) {
+			in_port_fill(p);
+			continue;
+		}
+		char *s = p->buf + p->pos;
+		while (*s && isspace(*s)) s++;
+		if (*s) panic("read: unexpected end of input\n");
+		push(&eof_obj);
+		return;
+	}
+	struct obj *datum = NULL;
+	char *s = p->buf + p->pos;
+	parse(&datum, &s);
+	p->pos = end - p->buf;
+	push(datum);
+}
+
+
+/// Promises
+
+static void
+make_promise(int nargs)
+{
+	/// (delay e) is expanded to (%delay (lambda () e))
+	(void)nargs;
+	struct promise *pr = scm_alloc(sizeof(struct promise), TPROMISE);
+	*pr = (struct promise){ .thunk = pop(), .done = false };
+	struct obj *res = scm_alloc(sizeof(struct obj), TPROMISE);
+	res->type = TPROMISE;
+	res->pval = pr;
+	res->vars = NULL;
+	push(res);
+}
+
+
+static struct obj *
+force_obj(struct obj *obj)
+{
+	if (!obj || obj->type != TPROMISE) return obj;
+	struct promise *pr = obj->pval;
+	if (!pr->done) {
+		call_obj(pr->thunk, 0);
+		struct obj *value = pop();
+		/// The thunk may have forced the promise itself
+		if (!pr->done) {
+			pr->value = value;
+			pr->done = true;
+			pr->thunk = NULL;
+		}
+	}
+	return pr->value;
+}
+
+
+static void
+force(int nargs)
+{
+	(void)nargs;
+	push(force_obj(pop()));
+}
+
+
+static void
+stream_cdr(int nargs)
+{
+	/// (cons-stream a b) is expanded to (list a (delay b))
+	(void)nargs;
+	struct obj *s = pop();
+	if (!s || s->type != TLIST || arrlen((struct obj **)s->pval) != 2) {
+		panic("stream-cdr: argument is not a stream pair\n");
+	}
+	push(force_obj(((struct obj **)s->pval)[1]));
+}
+
+
+/// Builtins are statically allocated. The compiler resolves references
+/// to them to their index in this table, so they are never looked up by
+/// name at runtime and need no initialization.
+struct builtin {
+	const char *name;
+	struct obj obj;
+	/// No effects, the compiler may remove or share calls
+	bool pure;
+};
+#define BUILTIN(name, fn) { name, { .type = TFUNC, .pval = fn, .vars = NULL }, false }
+#define PURE_BUILTIN(name, fn) { name, { .type = TFUNC, .pval = fn, .vars = NULL }, true }
+static struct builtin builtins[] = {
+	PURE_BUILTIN("+", add),
+	PURE_BUILTIN("-", sub),
+	PURE_BUILTIN("*", mul),
+	PURE_BUILTIN("/", div_float),
+	PURE_BUILTIN(">", gt),
+	PURE_BUILTIN(">=", ge),
+	PURE_BUILTIN("<", lt),
+	PURE_BUILTIN("<=", le),
+	PURE_BUILTIN("=", eq),
+	BUILTIN("list", list),
+	BUILTIN("car", car),
+	BUILTIN("cdr", cdr),
+	BUILTIN("cons", cons),
+	PURE_BUILTIN("null?", null_pred),
+	PURE_BUILTIN("length", length),
+	BUILTIN("append", append),
+	BUILTIN("make-hash-table", make_hash_table),
+	BUILTIN("hash-table-ref", hash_table_ref),
+	BUILTIN("hash-table-set!", hash_table_set),
+	BUILTIN("hash-table-delete!", hash_table_delete),
+	BUILTIN("hash-table-contains?", hash_table_contains),
+	BUILTIN("hash-table-count", hash_table_count),
+	BUILTIN("hash-table-keys", hash_table_keys),
+	BUILTIN("hash-table-values", hash_table_values),
+	BUILTIN("hash-table->alist", hash_table_to_alist),
+	BUILTIN("hash-table-walk", hash_table_walk),
+	PURE_BUILTIN("string-length", string_length),
+	BUILTIN("string-append", string_append),
+	PURE_BUILTIN("substring", substring),
+	PURE_BUILTIN("string=?", string_eq),
+	PURE_BUILTIN("string<?", string_lt),
+	PURE_BUILTIN("string->number", string_to_number),
+	PURE_BUILTIN("number->string", number_to_string),
+	PURE_BUILTIN("string->symbol", string_to_symbol),
+	PURE_BUILTIN("symbol->string", symbol_to_string),
+	BUILTIN("make-future", make_future),
+	BUILTIN("touch", touch),
+	BUILTIN("pmap", pmap),
+	BUILTIN("make-generator", make_generator),
+	BUILTIN("generator-next", generator_next),
+	BUILTIN("yield", yield),
+	PURE_BUILTIN("eof-object", eof_object),
+	PURE_BUILTIN("eof-object?", eof_object_pred),
+	BUILTIN("sort", sort),
+	BUILTIN("list-sort", list_sort),
+	BUILTIN("sort!", sort_bang),
+	BUILTIN("map", map),
+	BUILTIN("for-each", for_each),
+	BUILTIN("filter", filter),
+	BUILTIN("fold-left", fold_left),
+	BUILTIN("fold-right", fold_right),
+	BUILTIN("reduce", reduce),
+	BUILTIN("open-input-file", open_input_file),
+	BUILTIN("close-input-port", close_input_port),
+	BUILTIN("read-line", read_line),
+	BUILTIN("read-char", read_char),
+	BUILTIN("peek-char", peek_char),
+	BUILTIN("read", read_datum),
+	BUILTIN("%delay", make_promise),
+	BUILTIN("force", force),
+	BUILTIN("stream-car", car),
+	BUILTIN("stream-cdr", stream_cdr),
+};
+#define NBUILTINS ((int)(sizeof(builtins) / sizeof(builtins[0])))
+
+
+static int
+builtin_index(const char *name)
+{
+	for (int i = 0; i < NBUILTINS; i++) {
+		if (strcmp(builtins[i].name, name) == 0) return i;
+	}
+	return -1;
+}
+
+
+static bool
+builtin_pure(int idx)
 {
-	struct obj *res = malloc(sizeof(struct obj));
-	res->type = TNUM;
-	res->pval = malloc(sizeof(mpf_t));
-	res->envidx = 0;
-	if (op >= 0) {
-		mpf_init_set_ui(res->pval, op);
-	} else {
-		mpf_init_set_si(res->pval, op);
-	}
-	return res;
+	return idx >= 0 && builtins[idx].pure;
 }
 
 
-struct obj *
-gen_obj_list(void)
+/// Function names for reports
+
+void
+name_fn(func *fn, const char *name)
 {
-	struct obj *res = malloc(sizeof(struct obj));
-	res->type = TLIST;
-	res->pval = NULL;
-	res->envidx = 0;
-	return res;
+	hmput(fn_names, fn, name);
 }
 
 
-struct obj *
-gen_obj_fn(func fn, int idx)
+static const char *
+fn_name(func *fn)
 {
-	struct obj *res = malloc(sizeof(struct obj));
-	res->type = TFUNC;
-	res->pval = (func*)fn;
-	// res->envidx = envcur;
-	res->envidx = idx;
-	// new_env();
-	return res;
+	if (!fn) return "<toplevel>";
+	ptrdiff_t idx = hmgeti(fn_names, fn);
+	if (idx >= 0) return fn_names[idx].value;
+	/// Builtins are reported under their names
+	for (int i = 0; i < NBUILTINS; i++) {
+		if (builtins[i].obj.pval == fn) return builtins[i].name;
+	}
+	char *name = malloc(32);
+	snprintf(name, 32, "func %p", fn);
+	return name;
 }
 
 
-/// Builtin functions called by the runtime/VM
-static void
-add(int nargs)
+/// Profiler
+
+static inline uint64_t
+prof_now(void)
 {
-	(void)nargs;
-	struct obj *res = gen_obj_int(0);
-	mpf_add(res->pval, pop()->pval, pop()->pval);
-	push(res);
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
 }
 
 
-static void
-sub(int nargs)
+void
+prof_init(void)
 {
-	(void)nargs;
-	struct obj *res = gen_obj_int(0);
-	mpf_sub(res->pval, pop()->pval, pop()->pval);
-	push(res);
+	prof_enabled = true;
+	tracing = true;
+	prof_start = prof_now();
 }
 
 
 static void
-mul(int nargs)
+prof_enter(func *fn)
 {
-	(void)nargs;
-	struct obj *res = gen_obj_int(0);
-	struct obj *o2 = pop();
-	struct obj *o1 = pop();
-	if (o1 == NULL || o2 == NULL) {
-		fprintf(stderr, "arguments for '*' are NULL\n");
+	ptrdiff_t idx = hmgeti(prof_tab, fn);
+	if (idx < 0) {
+		struct prof_rec rec = {0};
+		hmput(prof_tab, fn, rec);
+		idx = hmgeti(prof_tab, fn);
 	}
-	mpf_mul(res->pval, o1->pval, o2->pval);
-	push(res);
+	prof_tab[idx].value.calls++;
+	prof_tab[idx].value.active++;
+	struct prof_frame fr = { .rec = idx, .start = prof_now(), .child = 0 };
+	arrput(prof_stack, fr);
 }
 
 
 static void
-div_float(int nargs)
+prof_leave(void)
 {
-	(void)nargs;
-	struct obj *res = gen_obj_float(0.0);
-	struct obj *o2 = pop();
-	struct obj *o1 = pop();
-	if (o1 == NULL || o2 == NULL) {
-		fprintf(stderr, "arguments for '/' are NULL\n");
-	}
-	mpf_div(res->pval, o1->pval, o2->pval);
-	push(res);
+	struct prof_frame fr = arrpop(prof_stack);
+	uint64_t elapsed = prof_now() - fr.start;
+	struct prof_rec *rec = &prof_tab[fr.rec].value;
+	rec->active--;
+	rec->excl += elapsed - fr.child;
+	/// Only the outermost of recursive activations counts as inclusive time
+	if (rec->active == 0) rec->incl += elapsed;
+	if (arrlen(prof_stack) > 0) prof_stack[arrlen(prof_stack) - 1].child += elapsed;
 }
 
 
-static void
-gt(int nargs)
+static int
+prof_cmp(const void *a, const void *b)
 {
-	(void)nargs;
-	struct obj *res = gen_obj_bool(false);
-	int r = mpf_cmp(pop()->pval, pop()->pval);
-	if (r > 0) *(bool *)res->pval = true;
-	push(res);
+	const struct prof_rec *ra = a, *rb = b;
+	return (ra->excl < rb->excl) - (ra->excl > rb->excl);
 }
 
 
 static void
-lt(int nargs)
+prof_report(void)
 {
-	(void)nargs;
-	struct obj *res = gen_obj_bool(false);
-	int r = mpf_cmp(pop()->pval, pop()->pval);
-	if (r < 0) *(bool *)res->pval = true;
-	push(res);
+	uint64_t total = prof_now() - prof_start;
+	struct prof_rec *recs = NULL;
+	for (ptrdiff_t i = 0; i < hmlen(prof_tab); i++) {
+		if (!prof_tab[i].value.calls) continue;
+		prof_tab[i].value.name = fn_name(prof_tab[i].key);
+		arrput(recs, prof_tab[i].value);
+	}
+	qsort(recs, arrlenu(recs), sizeof(struct prof_rec), prof_cmp);
+#if defined(__x86_64__) || defined(__i386__)
+	const char *unit = "cycles";
+#else
+	const char *unit = "ns";
+#endif
+	fprintf(stderr, "Flat profile (%s), total %lu:\n", unit, (unsigned long int)total);
+	fprintf(stderr, "%7s %14s %14s %10s  %s\n", "%self", "self", "total", "calls", "name");
+	for (size_t i = 0; i < arrlenu(recs); i++) {
+		fprintf(stderr, "%7.2f %14lu %14lu %10lu  %s\n",
+			total ? 100.0 * recs[i].excl / total : 0.0,
+			(unsigned long int)recs[i].excl, (unsigned long int)recs[i].incl,
+			recs[i].calls, recs[i].name);
+	}
+	arrfree(recs);
 }
 
 
+/// Allocation statistics
+
 static void
-ge(int nargs)
+alloc_account(int kind, size_t oldsize, size_t newsize)
 {
-	(void)nargs;
-	struct obj *res = gen_obj_bool(false);
-	int r = mpf_cmp(pop()->pval, pop()->pval);
-	if (r >= 0) *(bool *)res->pval = true;
-	push(res);
+	/// Allocations of the statistics tables themselves are not accounted
+	if (alloc_busy) return;
+	if (newsize <= oldsize) {
+		heap_live -= oldsize - newsize;
+		return;
+	}
+	size_t bytes = newsize - oldsize;
+	heap_live += bytes;
+	if (heap_live > heap_peak) heap_peak = heap_live;
+	alloc_by_kind[kind].count++;
+	alloc_by_kind[kind].bytes += bytes;
+	alloc_busy = true;
+	ptrdiff_t idx = hmgeti(alloc_by_fn, cur_fn);
+	if (idx < 0) {
+		struct alloc_stat st = {0};
+		hmput(alloc_by_fn, cur_fn, st);
+		idx = hmgeti(alloc_by_fn, cur_fn);
+	}
+	alloc_by_fn[idx].value.count++;
+	alloc_by_fn[idx].value.bytes += bytes;
+	alloc_busy = false;
 }
 
 
-static void
-le(int nargs)
+void *
+scm_realloc(void *ptr, size_t size, int kind)
 {
-	(void)nargs;
-	struct obj *res = gen_obj_bool(false);
-	int r = mpf_cmp(pop()->pval, pop()->pval);
-	if (r <= 0) *(bool *)res->pval = true;
-	push(res);
+	if (!alloc_enabled) return realloc(ptr, size);
+	size_t oldsize = ptr ? malloc_usable_size(ptr) : 0;
+	void *res = realloc(ptr, size);
+	alloc_account(kind, oldsize, res ? malloc_usable_size(res) : 0);
+	return res;
 }
 
 
-static void
-eq(int nargs)
+void *
+scm_alloc(size_t size, int kind)
 {
-	(void)nargs;
-	struct obj *res = gen_obj_bool(false);
-	int r = mpf_cmp(pop()->pval, pop()->pval);
-	if (r == 0) *(bool *)res->pval = true;
-	push(res);
+	return scm_realloc(NULL, size, kind);
 }
 
 
-static void
-list(int nargs)
+void
+scm_free(void *ptr)
 {
-	struct obj *res = gen_obj_list();
-	struct obj **darr = NULL;
-	darr = arraddnptr(darr, nargs);
-	for (int i = nargs - 1; i >= 0; i--) {
-		darr[i] = pop();
-	}
-	res->pval = darr;
-	push(res);
+	if (alloc_enabled && ptr) alloc_account(AK_LAST, malloc_usable_size(ptr), 0);
+	free(ptr);
 }
 
 
-static void
-car(int nargs)
+static void *
+gmp_alloc(size_t size)
 {
-	(void)nargs;
-	struct obj **darr = pop()->pval;
-	struct obj *res = darr[0];
-	push(res);
+	return scm_realloc(NULL, size, AK_BIGNUM);
 }
 
 
-static void
-cdr(int nargs)
+static void *
+gmp_realloc(void *ptr, size_t oldsize, size_t size)
 {
-	(void)nargs;
-	struct obj *res = gen_obj_list();
-	struct obj **iarr = pop()->pval;
-	struct obj **oarr = NULL;
-	size_t oarrlen = arrlenu(iarr) - 1;
-	oarr = arraddnptr(oarr, oarrlen);
-	for (size_t i = 0; i < oarrlen; i++) {
-		oarr[i] = iarr[i + 1];
-	}
-	res->pval = oarr;
-	push(res);
+	(void)oldsize;
+	return scm_realloc(ptr, size, AK_BIGNUM);
 }
 
 
 static void
-cons(int nargs)
+gmp_free(void *ptr, size_t size)
 {
-	(void)nargs;
-	struct obj *res = gen_obj_list();
-	struct obj **iarr = pop()->pval;
-	struct obj *iel = pop();
-	struct obj **oarr = NULL;
-	size_t oarrlen = arrlenu(iarr) + 1;
-	oarr = arraddnptr(oarr, oarrlen);
-	oarr[0] = iel;
-	for (size_t i = 1; i < oarrlen; i++) {
-		oarr[i] = iarr[i - 1];
-	}
-	res->pval = oarr;
-	push(res);
+	(void)size;
+	scm_free(ptr);
 }
 
 
-static void
-null_pred(int nargs)
+void
+alloc_stats_init(void)
 {
-	(void)nargs;
-	struct obj *o = pop();
-	bool resval = false;
-	if (o->type == TLIST) {
-		struct obj **iarr = o->pval;
-		resval = arrlenu(iarr) == 0;
-	}
-	struct obj *res = gen_obj_bool(resval);
-	push(res);
+	/// Must run before the first allocation to be accounted, also of GMP
+	char *mode = getenv("SCHEMEL_ALLOC_STATS");
+	alloc_json = mode && strcmp(mode, "json") == 0;
+	if (alloc_enabled) return;
+	alloc_enabled = true;
+	tracing = true;
+	mp_set_memory_functions(gmp_alloc, gmp_realloc, gmp_free);
 }
 
 
-static void
-length(int nargs)
+static int
+alloc_cmp(const void *a, const void *b)
 {
-	(void)nargs;
-	struct obj **iarr = pop()->pval;
-	struct obj *res = gen_obj_int(arrlenu(iarr));
-	push(res);
+	const struct alloc_fn_stat *sa = a, *sb = b;
+	return (sa->value.bytes < sb->value.bytes) - (sa->value.bytes > sb->value.bytes);
 }
 
 
 static void
-append(int nargs)
+json_str(FILE *f, const char *s)
 {
-	(void)nargs;
-	struct obj *res = gen_obj_list();
-	struct obj **iarr2 = pop()->pval;
-	struct obj **iarr1 = pop()->pval;
-	struct obj **oarr = NULL;
-	size_t oarrlen = arrlenu(iarr1) + arrlenu(iarr2);
-	oarr = arraddnptr(oarr, oarrlen);
-	for (size_t i = 0; i < arrlenu(iarr1); i++) {
-		oarr[i] = iarr1[i];
-	}
-	for (size_t i = 0; i < arrlenu(iarr2); i++) {
-		oarr[i + arrlenu(iarr1)] = iarr2[i];
+	fputc('"', f);
+	for (; *s; s++) {
+		if (*s == '"' || *s == '\\') fputc('\\', f);
+		fputc(*s, f);
 	}
-	res->pval = oarr;
-	push(res);
+	fputc('"', f);
 }
 
 
-bool
-init_builtins()
-{
-    shput(env[0].e, "+", gen_obj_fn(add, 0));
-    shput(env[0].e, "-", gen_obj_fn(sub, 0));
-    shput(env[0].e, "*", gen_obj_fn(mul, 0));
-    shput(env[0].e, "/", gen_obj_fn(div_float, 0));
-    shput(env[0].e, ">", gen_obj_fn(gt, 0));
-    shput(env[0].e, ">=", gen_obj_fn(ge, 0));
-    shput(env[0].e, "<", gen_obj_fn(lt, 0));
-    shput(env[0].e, "<=", gen_obj_fn(le, 0));
-    shput(env[0].e, "=", gen_obj_fn(eq, 0));
-    shput(env[0].e, "list", gen_obj_fn(list, 0));
-    shput(env[0].e, "car", gen_obj_fn(car, 0));
-    shput(env[0].e, "cdr", gen_obj_fn(cdr, 0));
-    shput(env[0].e, "cons", gen_obj_fn(cons, 0));
-    shput(env[0].e, "null?", gen_obj_fn(null_pred, 0));
-    shput(env[0].e, "length", gen_obj_fn(length, 0));
-    shput(env[0].e, "append", gen_obj_fn(append, 0));
-    return true;
+static void
+alloc_report(void)
+{
+	alloc_busy = true;
+	/// Sorting the hash map in place would break its index, a copy is sorted
+	ptrdiff_t nfns = hmlen(alloc_by_fn);
+	struct alloc_fn_stat *fns = malloc((nfns + 1) * sizeof(*fns));
+	memcpy(fns, alloc_by_fn, nfns * sizeof(*fns));
+	qsort(fns, nfns, sizeof(*fns), alloc_cmp);
+	if (alloc_json) {
+		fprintf(stderr, "{\"live\": %zu, \"peak\": %zu, \"types\": {", heap_live, heap_peak);
+		for (int k = 0; k < AK_LAST; k++) {
+			fprintf(stderr, "%s\"%s\": {\"count\": %lu, \"bytes\": %zu}", k ? ", " : "",
+				alloc_kind_names[k], alloc_by_kind[k].count, alloc_by_kind[k].bytes);
+		}
+		fprintf(stderr, "}, \"functions\": [");
+		for (ptrdiff_t i = 0; i < nfns; i++) {
+			fprintf(stderr, "%s{\"name\": ", i ? ", " : "");
+			json_str(stderr, fn_name(fns[i].key));
+			fprintf(stderr, ", \"count\": %lu, \"bytes\": %zu}",
+				fns[i].value.count, fns[i].value.bytes);
+		}
+		fprintf(stderr, "]}\n");
+	} else {
+		fprintf(stderr, "Allocations: %zu bytes live, %zu bytes peak\n", heap_live, heap_peak);
+		fprintf(stderr, "%10s %14s  %s\n", "count", "bytes", "type");
+		for (int k = 0; k < AK_LAST; k++) {
+			if (!alloc_by_kind[k].count) continue;
+			fprintf(stderr, "%10lu %14zu  %s\n",
+				alloc_by_kind[k].count, alloc_by_kind[k].bytes, alloc_kind_names[k]);
+		}
+		fprintf(stderr, "%10s %14s  %s\n", "count", "bytes", "function");
+		for (ptrdiff_t i = 0; i < nfns; i++) {
+			fprintf(stderr, "%10lu %14zu  %s\n", fns[i].value.count,
+				fns[i].value.bytes, fn_name(fns[i].key));
+		}
+	}
+	free(fns);
+	alloc_busy = false;
 }
 
 
@@ -908,13 +5965,10 @@ QUOTE(char *sexp)
 bool
 init_runtime()
 {
-	for (int eidx = 0; eidx < MAX_ENV; eidx++) {
-	    env[eidx].e = NULL;
-	    env[eidx].pidx = -1;
-	}
-	arrput(parent_env, 0);
-	init_builtins();
-	mpf_set_default_prec(FLOAT_PREC);
+	if (getenv("SCHEMEL_ALLOC_STATS")) alloc_stats_init();
+	out_port.f = stdout;
+	/// Output buffered in out_port must survive a panic()
+	atexit(flush_out_port);
 	return true;
 }
 
@@ -923,7 +5977,10 @@ bool
 deinit_runtime()
 {
 	/// TODO we should destroy the whole environment tree
-	shfree(env[0].e);
+	if (prof_enabled) prof_report();
+	if (alloc_enabled) alloc_report();
+	shfree(env->e);
+	port_flush(&out_port);
     return true;
 }
 
@@ -938,13 +5995,19 @@ is_true(struct obj *obj)
 }
 
 
+static void
+grow_stack(void)
+{
+	stack_cap = stack_cap ? stack_cap * 2 : STACK_MIN;
+	stack = realloc(stack, stack_cap * sizeof(struct obj *));
+	if (!stack) panic("stack overflow\n");
+}
+
+
 void
 push(struct obj *obj)
 {
-	if (sp == MAX_STACK - 1) {
-		fprintf(stderr, "stack overflow\n");
-		return;
-	}
+	if (sp + 1 >= stack_cap) grow_stack();
 	sp++;
 	stack[sp] = obj;
 }
@@ -964,44 +6027,44 @@ pop(void)
 }
 
 
-void
-new_env(int eidx, int pidx)
+static unsigned long int
+new_version(void)
 {
-	envmax = eidx > envmax ? eidx : envmax;
-	env[eidx].e = NULL;
-	env[eidx].pidx = pidx;
+	return __atomic_add_fetch(&last_version, 1, __ATOMIC_RELAXED);
 }
 
 
 void
-define_local(struct obj *obj, char *name)
+define_global(struct obj *obj, char *name)
 {
-    shput(env[envcur[envcur_sp]].e, name, obj);
+	shput(env->e, name, obj);
+	/// Invalidates all inline caches of the thread
+	global_version = env->version = new_version();
 }
 
 
-void
-define_global(struct obj *obj, char *name)
+struct obj *
+retrieve_symbol(char *name)
 {
-    shput(env[0].e, name, obj);
+	/// Only globals are looked up by name
+	struct obj *ret = shget(env->e, name);
+	if (ret) return ret;
+	int idx = builtin_index(name);
+	if (idx < 0) panic("could not retrieve symbol '%s'\n", name);
+	return &builtins[idx].obj;
 }
 
 
 struct obj *
-retrieve_symbol(char *name)
+retrieve_global(struct global_cache *cache, char *name, int builtin)
 {
-	// print_env();
-	/// Search tree for symbol, starting with envcur
-	///       and iterating over all parents until global env is reached
-	int eidx = envcur[envcur_sp];
-	// fprintf(stderr, "retrieving %s from env %d\n", name, eidx);
-	while (eidx != -1) {
-		struct obj *ret = shget(env[eidx].e, name);
-		if (ret) return ret;
-		eidx = env[eidx].pidx;
-	}
-	panic("could not retrieve symbol '%s'\n", name);
-	return NULL;
+	/// Definitions shadow the builtins
+	struct obj *ret = shget(env->e, name);
+	if (!ret && builtin >= 0) ret = &builtins[builtin].obj;
+	if (!ret) panic("could not retrieve symbol '%s'\n", name);
+	cache->value = ret;
+	cache->version = global_version;
+	return ret;
 }
 
 
@@ -1011,73 +6074,232 @@ call_obj(struct obj *obj, int nargs)
 	(void)nargs;
 	if (!obj) panic("cannot call nil");
 	if (obj->type != TFUNC) panic("attempt to call non-function object");
-	// fprintf(stderr, "calling %p with env %d\n", obj->pval, obj->envidx);
 	func *fn = (func*)(obj->pval);
-	envcur_sp++;
-	envcur[envcur_sp] = obj->envidx;
-	fn(nargs);
-	envcur[envcur_sp] = 0;
-	envcur_sp--;
+	cur_closure = obj;
+	if (tracing) {
+		/// All interpreted lambdas run in run_closure(), they are counted
+		/// by their code instead
+		func *key = fn == run_closure ? (func *)obj->vars[0]->pval : fn;
+		func *caller = cur_fn;
+		cur_fn = key;
+		if (prof_enabled) prof_enter(key);
+		fn(nargs);
+		if (prof_enabled) prof_leave();
+		cur_fn = caller;
+	} else {
+		fn(nargs);
+	}
 }
 
 
-/// FIXME Stack smash with print_obj with the AST of the code in test/006.scm
-int
-obj_tostr(char *str, struct obj *obj)
+struct obj **
+closure_vars(void)
 {
-	int ret = 0;
-	if (!obj) {
-		return ret;
-	}
-	struct obj **darr = obj->pval;
-	struct obj *olist = obj->pval;
-	int l = 0;
-	long int num = 0;
-	// mp_exp_t exp = 0;
-	// size_t mantlen;
+	/// Called by a compiled lambda on entry, before it calls anything else
+	return cur_closure->vars;
+}
+
+
+/// Output ports
+
+void
+port_write(struct port *p, const char *s, size_t len)
+{
+	memcpy(arraddnptr(p->buf, len), s, len);
+	if (p->f && arrlenu(p->buf) >= PORT_BUFLEN) port_flush(p);
+}
+
+
+void
+port_puts(struct port *p, const char *s)
+{
+	port_write(p, s, strlen(s));
+}
+
+
+void
+port_putc(struct port *p, char c)
+{
+	arrput(p->buf, c);
+	if (p->f && arrlenu(p->buf) >= PORT_BUFLEN) port_flush(p);
+}
+
+
+void
+port_flush(struct port *p)
+{
+	if (!p->f) return;
+	if (arrlenu(p->buf) > 0) fwrite(p->buf, 1, arrlenu(p->buf), p->f);
+	fflush(p->f);
+	arrsetlen(p->buf, 0);
+}
+
+
+static void
+flush_out_port(void)
+{
+	port_flush(&out_port);
+}
+
+
+static void
+write_num(struct port *p, struct obj *obj)
+{
+	/// Fast path for numbers that fit into a machine word, GMP for bignums.
+	/// Fractional parts are truncated.
+	if (mpf_fits_slong_p(obj->pval)) {
+		char digits[24];
+		char *d = digits + sizeof(digits);
+		long int num = mpf_get_si(obj->pval);
+		unsigned long int mag = num < 0 ? -(unsigned long int)num : (unsigned long int)num;
+		do {
+			*--d = '0' + mag % 10;
+			mag /= 10;
+		} while (mag);
+		if (num < 0) *--d = '-';
+		port_write(p, d, digits + sizeof(digits) - d);
+		return;
+	}
+	mpz_t z;
+	mpz_init(z);
+	mpz_set_f(z, obj->pval);
+	size_t maxlen = mpz_sizeinbase(z, 10) + 2;
+	size_t len = arrlenu(p->buf);
+	char *s = arraddnptr(p->buf, maxlen);
+	mpz_get_str(s, 10, z);
+	arrsetlen(p->buf, len + strlen(s));
+	mpz_clear(z);
+	if (p->f && arrlenu(p->buf) >= PORT_BUFLEN) port_flush(p);
+}
+
+
+static void
+write_str(struct port *p, struct string *str, bool readable)
+{
+	if (!readable) {
+		port_write(p, str_data(str), str->len);
+		return;
+	}
+	port_putc(p, '"');
+	for (size_t i = 0; i < str->len; i++) {
+		char c = str_data(str)[i];
+		if (c == '"' || c == '\\') port_putc(p, '\\');
+		if (c == '\n') port_puts(p, "\\n");
+		else if (c == '\t') port_puts(p, "\\t");
+		else port_putc(p, c);
+	}
+	port_putc(p, '"');
+}
+
+
+static void
+write_atom(struct port *p, struct obj *obj, bool readable)
+{
+	char fn_s[32];
+	if (!obj) return;
 	switch(obj->type) {
 	case TBOOL:
-		ret = sprintf(str, "%s", *(bool *)obj->pval ? "#t" : "#f");
+		port_puts(p, *(bool *)obj->pval ? "#t" : "#f");
 		break;
 	case TNUM:
-		/// FIXME convert multi precision floats to string
-		// mpz_get_str(str, 10, obj->pval);
-
-		num = mpf_get_si(obj->pval);
-		sprintf(str, "%ld", num);
-
-		// mpf_get_str(str, &exp, 10, MAX_VALLEN - 2, obj->pval);
-		// mantlen = strlen(str);
-		// mp_exp_t i;
-		// for (i = 0; i < exp; i++) str[mantlen + i] = '0';
-		// str[i] = '\0';
-
-		ret = strlen(str);
+		write_num(p, obj);
 		break;
 	case TSYMB:
-		l = strlen((char *)obj->pval);
-		memcpy(str, obj->pval, l);
-		ret = l;
-		break;
-	case TLIST:
-		*str++ = '(';
-		ret++;
-		for (size_t i = 0; i < arrlenu(olist); i++) {
-			l = obj_tostr(str, darr[i]);
-			str += l;
-			ret += l;
-			if (i < arrlenu(olist) - 1) {
-				*str++ = ' ';
-				ret++;
-			}
-		}
-		*str++ = ')';
-		ret++;
+		port_puts(p, obj->pval);
 		break;
 	case TFUNC:
-		ret = sprintf(str, "func %p", obj->pval);
+		snprintf(fn_s, sizeof(fn_s), "func %p", obj->pval);
+		port_puts(p, fn_s);
+		break;
+	case THASH:
+		snprintf(fn_s, sizeof(fn_s), "hash-table %p", obj->pval);
+		port_puts(p, fn_s);
 		break;
+	case TSTRING:
+		write_str(p, obj->pval, readable);
+		break;
+	case TFUTURE:
+		snprintf(fn_s, sizeof(fn_s), "future %p", obj->pval);
+		port_puts(p, fn_s);
+		break;
+	case TGENERATOR:
+		snprintf(fn_s, sizeof(fn_s), "generator %p", obj->pval);
+		port_puts(p, fn_s);
+		break;
+	case TEOF:
+		port_puts(p, "#<eof>");
+		break;
+	case TPORT:
+		snprintf(fn_s, sizeof(fn_s), "port %p", obj->pval);
+		port_puts(p, fn_s);
+		break;
+	case TPROMISE:
+		snprintf(fn_s, sizeof(fn_s), "promise %p", obj->pval);
+		port_puts(p, fn_s);
+		break;
+	}
+}
+
+
+/// Print obj to p, readable selects write over display representation
+static void
+put_obj(struct port *p, struct obj *obj, bool readable)
+{
+	/// Lists are traversed with an explicit stack of frames,
+	/// so arbitrarily deep nesting doesn't grow the C stack
+	struct print_frame { struct obj **items; size_t idx; };
+	struct print_frame *frames = NULL;
+	for (;;) {
+		if (obj && obj->type == TLIST) {
+			port_putc(p, '(');
+			struct print_frame fr = { .items = obj->pval, .idx = 0 };
+			arrput(frames, fr);
+		} else {
+			write_atom(p, obj, readable);
+		}
+		/// Close finished lists and fetch the next element to print
+		for (;;) {
+			if (arrlen(frames) == 0) {
+				arrfree(frames);
+				return;
+			}
+			struct print_frame *fr = &frames[arrlen(frames) - 1];
+			if (fr->idx < arrlenu(fr->items)) {
+				if (fr->idx > 0) port_putc(p, ' ');
+				obj = fr->items[fr->idx++];
+				break;
+			}
+			port_putc(p, ')');
+			arrsetlen(frames, arrlen(frames) - 1);
+		}
 	}
+}
+
+
+void
+write_obj(struct port *p, struct obj *obj)
+{
+	put_obj(p, obj, true);
+}
+
+
+void
+display_obj(struct port *p, struct obj *obj)
+{
+	put_obj(p, obj, false);
+}
+
+
+char *
+obj_tostr(struct obj *obj)
+{
+	struct port sp = { .f = NULL, .buf = NULL };
+	write_obj(&sp, obj);
+	size_t len = arrlenu(sp.buf);
+	char *ret = malloc(len + 1);
+	memcpy(ret, sp.buf, len);
+	ret[len] = '\0';
+	arrfree(sp.buf);
 	return ret;
 }
 
@@ -1089,8 +6311,10 @@ print_obj(struct obj *obj)
 		fprintf(stderr, "attempt to print NULL object\n");
 		return;
 	}
-	char val_s[MAX_VALLEN] = {0};
-	if (obj_tostr(val_s, obj) > 0) puts(val_s);
+	pthread_mutex_lock(&out_lock);
+	display_obj(&out_port, obj);
+	port_putc(&out_port, '\n');
+	pthread_mutex_unlock(&out_lock);
 }
 
 
@@ -1116,14 +6340,10 @@ print_stack()
 void
 print_env()
 {
-	int eidx = envcur[envcur_sp];
-	while (eidx != -1) {
-		fprintf(stderr, "ENV[%d]:\n", eidx);
-		for (int j = 0; j < shlen(env[eidx].e); j++) {
-			fprintf(stderr, "  %s:", env[eidx].e[j].key);
-			print_obj(env[eidx].e[j].value);
-		}
-		eidx = env[eidx].pidx;
+	fprintf(stderr, "ENV:\n");
+	for (int j = 0; j < shlen(env->e); j++) {
+		fprintf(stderr, "  %s:", env->e[j].key);
+		print_obj(env->e[j].value);
 	}
 }
 
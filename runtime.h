@@ -2,6 +2,7 @@
 #define __RUNTIME_DEF__
 
 #include <stdbool.h>
+#include <stdio.h>
 
 
 struct strview {
@@ -14,6 +15,7 @@ typedef enum token_type {
 	TOKPARR,
 	TOKNUM,
 	TOKSYMB,
+	TOKSTR,
 	TOKLAST
 } token_type;
 
@@ -28,48 +30,158 @@ enum types {
 	TSYMB,
 	TLIST,
 	TFUNC,
+	THASH,
+	TSTRING,
+	TFUTURE,
+	TGENERATOR,
+	TEOF,
+	TBOX,
+	TPORT,
+	TPROMISE,
 	TLAST
 };
 
+/// Kinds of allocations, object types and other runtime storage
+enum alloc_kinds {
+	AK_ARRAY = TLAST,
+	AK_BIGNUM,
+	AK_LAST
+};
+
+/// Procedures keep the values of their captured variables in vars
 struct obj {
 	int type;
 	void *pval;
-	int envidx;
+	struct obj **vars;
+};
+
+/// Value of a boxed variable, a captured variable that is assigned
+#define BOX_REF(box) ((struct obj *)(box)->pval)
+
+/// Inline cache of the lookup of a global at one site of the generated
+/// code. Every state of a global environment has a unique version, the
+/// cache is valid while the thread's environment has the version it was
+/// filled at.
+struct global_cache {
+	unsigned long int version;
+	struct obj *value;
+};
+extern _Thread_local unsigned long int global_version;
+#define GLOBAL_REF(cache, name, builtin) \
+	((cache).version == global_version ? (cache).value : retrieve_global(&(cache), name, builtin))
+
+/// Buffered output port, writing to a file or, if f is NULL,
+/// accumulating into buf (a stb_ds array)
+struct port {
+	FILE *f;
+	char *buf;
 };
 
 
 typedef void (func) (int);
 
+/// Compiler options
+struct options {
+	bool profile;
+	bool alloc_stats;
+	bool time_report;
+	/// Compile a library module to an object file instead of a program
+	bool module;
+	/// Print the optimized intermediate representation to stderr
+	bool dump_ir;
+	/// Run the program in process instead of compiling it
+	bool run;
+	/// Build with frame pointers and the address and undefined behavior
+	/// sanitizers
+	bool sanitize;
+	/// Translation units the lambdas of a program are split into and
+	/// compiled in parallel, 0 for one per core on large programs
+	int shards;
+	/// Compiler executable, run to compile imported modules
+	const char *self;
+};
+extern struct options options;
+
+/// Compiler statistics
+struct compile_stats {
+	size_t lambdas;
+	size_t units;
+	size_t emitted_bytes;
+};
+extern struct compile_stats compile_stats;
+
 bool init_runtime();
 bool deinit_runtime();
 char *read_file(char *file_name);
 void skip_space(char **ss);
 struct token next_tok(char **ss);
 void tok_str(char *s, struct token t);
+void parse_source(const char *file_name, char *src);
 int parse(struct obj **ast, char **sexpr_str);
 void emit(char *file_name, struct obj* ast);
 void build(char *file_name);
-void new_env(int eidx, int pidx);
+void write_interface(char *file_name, struct obj *ast);
+void run(char *file_name, struct obj *ast);
+/// Embedding: isolated instances of the runtime. scm_eval() runs the
+/// program src in ctx, scm_call() calls proc with nargs args. They store
+/// the value in *value, or return false on an error, which scm_error()
+/// describes, and the context stays usable.
+struct scm_ctx;
+struct scm_ctx *scm_ctx_new(void);
+void scm_ctx_free(struct scm_ctx *ctx);
+bool scm_eval(struct scm_ctx *ctx, const char *src, struct obj **value);
+bool scm_call(struct scm_ctx *ctx, struct obj *proc, int nargs, struct obj **args, struct obj **value);
+const char *scm_error(struct scm_ctx *ctx);
 /// Operations on objects and s-expressions
 struct obj *gen_obj_bool(bool op);
 struct obj *gen_obj_int(long int op);
 struct obj *gen_obj_int_strview(struct strview op);
 struct obj *gen_obj_symb(char *symb);
-struct obj *gen_obj_fn(func fn, int envidx);
+struct obj *gen_obj_fn(func fn);
+struct obj *gen_obj_closure(func fn, int nvars);
+struct obj *gen_obj_box(struct obj *value);
 struct obj *gen_obj_list(void);
+struct obj *gen_obj_hashtable(void);
+struct obj *gen_obj_str(const char *s, size_t len);
 int is_true(struct obj *obj);
 void sexp_append_obj_inplace(struct obj *list, struct obj *obj);
+size_t sexp_count_nodes(struct obj *obj);
 /// Runtime functions
 void push(struct obj *obj);
 struct obj *pop(void);
 struct obj *retrieve_symbol(char *name);
+struct obj *retrieve_global(struct global_cache *cache, char *name, int builtin);
 void define_global(struct obj *obj, char *name);
-void define_local(struct obj *obj, char *name);
 void call_obj(struct obj *obj, int nargs);
-int obj_tostr(char *str, struct obj *obj);
+/// Operations of builtins, called directly by compiled code
+struct obj *num_add(struct obj *a, struct obj *b);
+struct obj *num_sub(struct obj *a, struct obj *b);
+struct obj *num_mul(struct obj *a, struct obj *b);
+struct obj *num_div(struct obj *a, struct obj *b);
+int num_cmp(struct obj *a, struct obj *b);
+struct obj *list_car(struct obj *lst);
+struct obj *list_cdr(struct obj *lst);
+bool list_null(struct obj *obj);
+struct obj **closure_vars(void);
+/// Output ports
+extern struct port out_port;
+void port_write(struct port *p, const char *s, size_t len);
+void port_puts(struct port *p, const char *s);
+void port_putc(struct port *p, char c);
+void port_flush(struct port *p);
+void write_obj(struct port *p, struct obj *obj);
+void display_obj(struct port *p, struct obj *obj);
+char *obj_tostr(struct obj *obj);
 void print_obj(struct obj *obj);
 void print_stack();
 void print_env();
+/// Profiling and allocation statistics
+void name_fn(func *fn, const char *name);
+void prof_init(void);
+void alloc_stats_init(void);
+void *scm_alloc(size_t size, int kind);
+void *scm_realloc(void *ptr, size_t size, int kind);
+void scm_free(void *ptr);
 /// VM operations
 void QUOTE(char *sexp);
 
@@ -0,0 +1,5 @@
+(begin
+  (define fact (lambda (n)
+      (if (<= n 1) 1 (* n (fact (- n 1))))))
+  (display
+    (list (fact 25) (- 0 (fact 21)) (quote (1 (2 (3 (4 (5 ())))))))))
@@ -0,0 +1,14 @@
+(begin
+  (define h (make-hash-table))
+  (hash-table-set! h 1 (quote one))
+  (hash-table-set! h (quote b) 2)
+  (hash-table-set! h 1 (quote uno))
+  (hash-table-set! h 3 4)
+  (hash-table-delete! h 3)
+  (display
+    (list (hash-table-ref h 1) (hash-table-ref h (quote b)) (hash-table-ref h 3 0)
+          (hash-table-count h) (hash-table-contains? h 3) (hash-table-values (begin
+            (define g (make-hash-table))
+            (hash-table-set! g (quote k) (quote v))
+            g))))
+)
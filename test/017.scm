@@ -0,0 +1,10 @@
+(begin
+  (define s (string-append "hello" ", " "world"))
+  (define hello (substring s 0 5))
+  (define t (string-append hello "!"))
+  (define u (string-append t "?"))
+  (define v (string-append t "."))
+  (display
+    (list s hello u v (string-length s) (+ 1 (string->number "41"))
+          (string=? (substring s 7) "world") (quote ("a\"b" c))))
+)
@@ -0,0 +1,6 @@
+(begin
+  (define sq (lambda (x) (* x x)))
+  (define f (future (+ (sq 3) 1)))
+  (display
+    (list (touch f) (touch 7) (pmap sq (list 1 2 3 4 5 6 7 8 9 10))))
+)
@@ -0,0 +1,20 @@
+(begin
+  (define count-up (lambda (n)
+    (make-generator (lambda ()
+      (begin
+        (define up (lambda (i) (if (> i n) i (begin (yield i) (up (+ i 1))))))
+        (up 1))))))
+  (define squares (lambda (g)
+    (make-generator (lambda ()
+      (begin
+        (define next (lambda (v) (if (eof-object? v) v (begin (yield (* v v)) (next (generator-next g))))))
+        (next (generator-next g)))))))
+  (define sum (lambda (g acc)
+    (begin
+      (define v (generator-next g))
+      (if (eof-object? v) acc (sum g (+ acc v))))))
+  (define total (sum (squares (count-up 10)) 0))
+  (define g (count-up 2))
+  (display
+    (list total (generator-next g) (generator-next g) (generator-next g) (generator-next g)))
+)
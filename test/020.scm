@@ -0,0 +1,13 @@
+(begin
+  (define make-counter (lambda ()
+    (begin
+      (define n 0)
+      (lambda () (begin (set! n (+ n 1)) n)))))
+  (define c1 (make-counter))
+  (define c2 (make-counter))
+  (c1)
+  (c1)
+  (define adder (lambda (x) (lambda (y) (lambda (z) (+ x (+ y z))))))
+  (define fib (lambda (n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2))))))
+  (display (list (c1) (c2) (((adder 1) 2) 3) (((adder 10) 20) 30) (fib 15)))
+)
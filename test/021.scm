@@ -0,0 +1,9 @@
+(begin
+  (define f (lambda (x) (g x)))
+  (define g (lambda (x) (* x 2)))
+  (define head (lambda (l) (car l)))
+  (define a (list (f 5) (head (list 1 2))))
+  (define g (lambda (x) (+ x 1)))
+  (define car cdr)
+  (display (list a (f 5) (head (list 1 2))))
+)
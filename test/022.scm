@@ -0,0 +1,6 @@
+(begin
+  (import "lib/combinators.scm")
+  (import "lib/lists.scm")
+  (define inc (lambda (x) (+ x 1)))
+  (display (list ((compose inc inc) 1) (middle (list 1 2 3 4)) (take (list 5 6 7) 2)))
+)
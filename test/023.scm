@@ -0,0 +1,9 @@
+(begin
+  (define x 1)
+  (define bump (lambda () (begin (set! x (+ x 1)) x)))
+  (define sq2 (lambda (n) (+ (* n n) (* n n))))
+  (define lens (lambda (l)
+    (list (length l) (begin (set! length (lambda (y) 7)) (length l)))))
+  (define pick (lambda (p a b) (begin a b (if p (car a) (car b)))))
+  (display (list (list x (bump) x) (sq2 3) (pick 0 (list 4) (list 5)) (lens (list 1 2))))
+)
@@ -0,0 +1,41 @@
+(begin
+  (define x 10)
+  (define f (lambda (n)
+    (let ((x 1) (y x))
+      (let* ((a (+ x n)) (b (* a 2)))
+        (list x y a b)))))
+  (define sum (lambda (n)
+    (let loop ((i 0) (acc 0))
+      (if (> i n) acc (loop (+ i 1) (+ acc i))))))
+  (define evens (lambda (n)
+    (letrec ((ev? (lambda (k) (if (= k 0) 1 (od? (- k 1)))))
+             (od? (lambda (k) (if (= k 0) 0 (ev? (- k 1))))))
+      (ev? n))))
+  (define thunks (lambda ()
+    (let loop ((i 0) (acc (list)))
+      (if (= i 3) acc (loop (+ i 1) (cons (lambda () i) acc))))))
+  (define counter (lambda ()
+    (let ((n 0))
+      (lambda () (begin (set! n (+ n 1)) n)))))
+  (define c (counter))
+  (c)
+  (define pairs (lambda (n)
+    (let outer ((i 0) (acc (list)))
+      (if (= i n) acc
+        (outer (+ i 1)
+          (let inner ((j 0) (acc acc))
+            (if (= j i) acc (inner (+ j 1) (cons (list i j) acc)))))))))
+  (define fact (lambda (n)
+    (do ((i 1 (+ i 1)) (p 1 (* p i))) ((> i n) p))))
+  (define build (lambda (n)
+    (let rec ((k n)) (if (= k 0) (list) (cons k (rec (- k 1)))))))
+  (define boxes (let loop ((i 0) (fs (list)))
+    (if (= i 2) fs (loop (+ i 1) (cons (lambda () (begin (set! i (+ i 10)) i)) fs)))))
+  ((car boxes))
+  (define tl (thunks))
+  (display (list (f 5) (sum 100) (evens 10) ((car tl)) ((car (cdr tl))) (c)
+    ((car boxes)) ((car (cdr boxes)))
+    (pairs 3) (fact 10) (build 4)
+    (let ((v (let lp ((i 5)) (if (= i 0) 42 (lp (- i 1)))))) (+ v 1))
+    (let ((x 3)) (do ((i 0 (+ i 1))) ((= i 4) x) (set! x (* x 2))))))
+)
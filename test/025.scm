@@ -0,0 +1,10 @@
+(begin
+  (define pairs (list (list 3 (quote c)) (list 1 (quote a)) (list 3 (quote d)) (list 2 (quote b)) (list 1 (quote e))))
+  (define by-car (lambda (x y) (< (car x) (car y))))
+  (define nums (list 5 3 9 1 7 3 2 8 6 4 0 11 15 13 12 14 10 19 17 16 18))
+  (define sorted (sort nums <))
+  (define words (list "pear" "apple" "fig"))
+  (sort! words string<?)
+  (display (list sorted (car nums) (list-sort > (list 2 9 4)) (sort pairs by-car)
+    words (sort (list) <)))
+)
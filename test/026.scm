@@ -0,0 +1,10 @@
+(begin
+  (define xs (list 1 2 3 4 5))
+  (define sq (lambda (x) (* x x)))
+  (define total 0)
+  (for-each (lambda (x y) (set! total (+ total (* x y)))) xs (list 10 20 30))
+  (display (list (map sq xs) (map + xs (list 10 20 30)) (filter (lambda (x) (> x 2)) xs)
+    (fold-left - 0 xs) (fold-right cons (list) xs) (fold-left (lambda (acc x) (cons x acc)) (list) (list 1 2))
+    (fold-right list 0 xs (list 6 7 8 9 10)) (reduce + 0 xs) (reduce + 0 (list))
+    (reduce (lambda (x acc) (if (> x acc) x acc)) 0 (list 3 9 2)) total (map car (list (list 1 2) (list 3)))))
+)
@@ -0,0 +1,25 @@
+(begin
+  (define count-lines (lambda (port)
+    (let loop ((n 0))
+      (if (eof-object? (read-line port)) n (loop (+ n 1))))))
+  (define lines (lambda (port)
+    (let ((line (read-line port)))
+      (if (eof-object? line) (list) (cons-stream line (lines port))))))
+  (define stream-take (lambda (s n)
+    (if (= n 0) (list) (cons (stream-car s) (stream-take (stream-cdr s) (- n 1))))))
+  (define ints (lambda (k) (cons-stream k (ints (+ k 1)))))
+  (define forced 0)
+  (define p (delay (begin (set! forced (+ forced 1)) forced)))
+  (define src (open-input-file "test/027.scm"))
+  (define first (read-line src))
+  (define c (read-char src))
+  (define d (peek-char src))
+  (close-input-port src)
+  (define src2 (open-input-file "test/027.scm"))
+  (define prog (read src2))
+  (define after (read src2))
+  (display (list (string=? first "(begin") (string=? c " ") (string=? d " ") (car prog) (length prog) (eof-object? after)
+    (count-lines (open-input-file "test/027.scm"))
+    (map string-length (stream-take (lines (open-input-file "test/027.scm")) 3))
+    (stream-take (ints 0) 5) (force p) (force p) forced (force 7)))
+)
@@ -0,0 +1,9 @@
+(begin
+  (define cdr (lambda (l) (quote shadowed)))
+  (define count (lambda (n)
+    (do ((i 0 (+ i 1)) (acc 0 (if (> i 2) (+ acc i) acc))) ((>= i n) acc))))
+  (define len (lambda (l) (if (null? l) 0 (+ 1 (len (list))))))
+  (define both (lambda (a b) (let ((c (< a b))) (list c (if c (- b a) (/ a b))))))
+  (display (list (count 10) (len (list 1)) (both 1 3) (both 6 3) (= 2 2) (<= 3 2)
+    (* 4 (car (list 5))) (cdr (list 1 2))))
+)
@@ -0,0 +1,5 @@
+(begin
+  (import "lib/a/util.scm")
+  (import "lib/b/util.scm")
+  (display (list (first-of (list 1 2)) (second-of (list 1 2))))
+)
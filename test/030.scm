@@ -0,0 +1,13 @@
+(begin
+  (define f (lambda (l)
+    (define a (car l))
+    (sort! l <)
+    (list a (car l))))
+  (define g (lambda (l)
+    (let loop ((i 0) (acc (list)))
+      (if (= i 2) acc
+        (let ((x (car l)))
+          (sort! l <)
+          (loop (+ i 1) (cons x acc)))))))
+  (display (list (f (list 3 1 2)) (g (list 3 1 2))))
+)
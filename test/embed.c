@@ -0,0 +1,86 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+
+#include "runtime.h"
+
+/// Runs scripts in isolated contexts of the runtime embedded in one
+/// process, and prints their values and errors.
+
+static void
+print_value(struct scm_ctx *ctx, bool ok, struct obj *value)
+{
+	if (ok) printf("%s\n", value ? obj_tostr(value) : "#<void>");
+	else printf("error: %s\n", scm_error(ctx));
+}
+
+
+static void *
+run_script(void *arg)
+{
+	/// Each thread runs its own context
+	struct scm_ctx *ctx = scm_ctx_new();
+	struct obj *value = NULL;
+	scm_eval(ctx, "(define sum (lambda (n acc) (if (= n 0) acc (sum (- n 1) (+ acc n)))))", NULL);
+	bool ok = scm_eval(ctx, (char *)arg, &value);
+	char *res = ok ? obj_tostr(value) : NULL;
+	scm_ctx_free(ctx);
+	return res;
+}
+
+
+int
+main(void)
+{
+	struct scm_ctx *a = scm_ctx_new(), *b = scm_ctx_new();
+	struct obj *value = NULL;
+	scm_eval(a, "(define x 1) (define add-x (lambda (n) (+ n x)))", NULL);
+	scm_eval(b, "(define x 100)", NULL);
+	bool ok = scm_eval(a, "(add-x 41)", &value);
+	print_value(a, ok, value);
+	ok = scm_eval(b, "(add-x 41)", &value);
+	print_value(b, ok, value);
+	ok = scm_eval(b, "(car 1 2 (", &value);
+	print_value(b, ok, value);
+	ok = scm_eval(b, "x", &value);
+	print_value(b, ok, value);
+	struct obj *add_x = NULL;
+	scm_eval(a, "add-x", &add_x);
+	struct obj *args[] = { gen_obj_int(9) };
+	ok = scm_call(a, add_x, 1, args, &value);
+	print_value(a, ok, value);
+	ok = scm_call(a, args[0], 0, NULL, &value);
+	print_value(a, ok, value);
+	/// A compile error leaves no half compiled code behind
+	ok = scm_eval(a, "(define f (lambda (n) (let loop ((i 0) (a 0)) (if (= i n) a (loop (+ i 1))))))", &value);
+	print_value(a, ok, value);
+	ok = scm_eval(b, "(+ 1 2)", &value);
+	print_value(b, ok, value);
+	struct scm_ctx *c = scm_ctx_new();
+	ok = scm_eval(c, "(let loop ((i 0) (a 0)) (if (= i 3) a (loop (+ i 1) (+ a i))))", &value);
+	print_value(c, ok, value);
+	scm_ctx_free(c);
+	/// Errors in futures and generators are returned too
+	ok = scm_eval(a, "(touch (future (+ 1 undefined)))", &value);
+	print_value(a, ok, value);
+	ok = scm_eval(a, "(pmap (lambda (n) (+ n undefined)) (list 1 2 3))", &value);
+	print_value(a, ok, value);
+	scm_eval(a, "(define g (make-generator (lambda () (yield 1) (+ 1 undefined))))", NULL);
+	ok = scm_eval(a, "(generator-next g)", &value);
+	print_value(a, ok, value);
+	ok = scm_eval(a, "(generator-next g)", &value);
+	print_value(a, ok, value);
+	ok = scm_eval(a, "(generator-next g)", &value);
+	print_value(a, ok, value);
+	pthread_t th[4];
+	char *srcs[] = { "(sum 10 0)", "(sum 100 0)", "(sum 1000 0)", "(undefined 1)" };
+	for (int i = 0; i < 4; i++) pthread_create(&th[i], NULL, run_script, srcs[i]);
+	for (int i = 0; i < 4; i++) {
+		char *res;
+		pthread_join(th[i], (void **)&res);
+		printf("%s\n", res ? res : "error");
+	}
+	scm_ctx_free(a);
+	scm_ctx_free(b);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,3 @@
+(begin
+  (define first-of (lambda (l) (car l)))
+)
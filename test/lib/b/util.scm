@@ -0,0 +1,3 @@
+(begin
+  (define second-of (lambda (l) (car (cdr l))))
+)
@@ -0,0 +1,5 @@
+(begin
+  (import lists)
+  (define compose (lambda (f g) (lambda (x) (f (g x)))))
+  (define middle (lambda (l) (take (drop l 1) (- (length l) 2))))
+)
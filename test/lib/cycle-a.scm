@@ -0,0 +1,4 @@
+(begin
+  (import "cycle-b.scm")
+  (define a (lambda () 1))
+)
@@ -0,0 +1,4 @@
+(begin
+  (import "cycle-a.scm")
+  (define b (lambda () 2))
+)
@@ -0,0 +1,6 @@
+(begin
+  (define take (lambda (l n)
+    (if (= n 0) (list) (cons (car l) (take (cdr l) (- n 1))))))
+  (define drop (lambda (l n)
+    (if (= n 0) l (drop (cdr l) (- n 1)))))
+)